@@ -0,0 +1,398 @@
+/*
+ * Copyright © 2022 — 2023 Artsiom Karakin <karakin2000@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Interval analysis of compiled programs. Every frame slot gets range
+ * of values it may hold: literals are known exactly, variables have
+ * ranges declared for their symbols or full range. Operations which
+ * can't overflow or divide by zero for any values in ranges of their
+ * operands are replaced by unchecked ones.
+ */
+#include "argcalc.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+static struct range *declared;
+static int declared_size;
+
+/*
+ * Declare that variable sym always holds value from lo to hi
+ */
+void
+declare_range(int sym, long long int lo, long long int hi)
+{
+	struct range *d;
+
+	if (sym >= declared_size) {
+		if ((d = reallocarray(declared, sym + 16,
+		    sizeof(*declared))) == NULL)
+			errx(1, "Couldn't grow declared ranges");
+		for (int i = declared_size; i < sym + 16; i++) {
+			d[i].lo = LLONG_MIN;
+			d[i].hi = LLONG_MAX;
+		}
+		declared = d;
+		declared_size = sym + 16;
+	}
+	declared[sym].lo = lo;
+	declared[sym].hi = hi;
+}
+
+/*
+ * Get declared range of sym, full range if it wasn't declared.
+ * Returns 1 if range was declared
+ */
+int
+symbol_range(int sym, struct range *r)
+{
+	r->lo = LLONG_MIN;
+	r->hi = LLONG_MAX;
+	if (sym >= declared_size)
+		return 0;
+	*r = declared[sym];
+	return r->lo != LLONG_MIN || r->hi != LLONG_MAX;
+}
+
+/*
+ * Store [lo, hi] into r clipped to long long. Returns 1 if it fits
+ * without clipping
+ */
+static int
+clip(__int128 lo, __int128 hi, struct range *r)
+{
+	int fits = lo >= LLONG_MIN && hi <= LLONG_MAX;
+
+	r->lo = lo < LLONG_MIN ? LLONG_MIN : lo > LLONG_MAX ? LLONG_MAX : lo;
+	r->hi = hi > LLONG_MAX ? LLONG_MAX : hi < LLONG_MIN ? LLONG_MIN : hi;
+	return fits;
+}
+
+static void
+minmax4(__int128 v[4], __int128 *lo, __int128 *hi)
+{
+	*lo = *hi = v[0];
+	for (int i = 1; i < 4; i++) {
+		if (v[i] < *lo)
+			*lo = v[i];
+		if (v[i] > *hi)
+			*hi = v[i];
+	}
+}
+
+/*
+ * Compute range of result of op applied to ranges a and b. Operation
+ * fails if result doesn't fit, so result range is clipped. Returns 1
+ * if op can't fail for any operands from these ranges
+ */
+int
+range_op(int op, const struct range *a, const struct range *b,
+    struct range *r)
+{
+	__int128 v[4], lo, hi, m;
+
+	switch (op) {
+	case OP_ADD:
+		return clip((__int128)a->lo + b->lo, (__int128)a->hi + b->hi,
+		    r);
+	case OP_SUB:
+		return clip((__int128)a->lo - b->hi, (__int128)a->hi - b->lo,
+		    r);
+	case OP_MUL:
+		v[0] = (__int128)a->lo * b->lo;
+		v[1] = (__int128)a->lo * b->hi;
+		v[2] = (__int128)a->hi * b->lo;
+		v[3] = (__int128)a->hi * b->hi;
+		minmax4(v, &lo, &hi);
+		if (clip(lo, hi, r))
+			return 1;
+		/* multiply() lets positive by negative wrap around */
+		r->lo = LLONG_MIN;
+		r->hi = LLONG_MAX;
+		return 0;
+	case OP_LT:
+	case OP_GT:
+	case OP_LE:
+	case OP_GE:
+	case OP_EQ:
+	case OP_NE:
+		r->lo = 0;
+		r->hi = 1;
+		return 1;
+	case OP_DIV:
+		if (b->lo <= 0 && b->hi >= 0) {
+			/* Quotient is never bigger than dividend */
+			m = -(__int128)a->lo;
+			if ((__int128)a->hi > m)
+				m = a->hi;
+			if (m < 0)
+				m = -m;
+			clip(-m, m, r);
+			return 0;
+		}
+		/* Divisor has one sign, extremes are at the corners */
+		v[0] = (__int128)a->lo / b->lo;
+		v[1] = (__int128)a->lo / b->hi;
+		v[2] = (__int128)a->hi / b->lo;
+		v[3] = (__int128)a->hi / b->hi;
+		minmax4(v, &lo, &hi);
+		return clip(lo, hi, r);
+	default:
+		r->lo = LLONG_MIN;
+		r->hi = LLONG_MAX;
+		return 0;
+	}
+}
+
+/*
+ * Division by constant is monotonic, so range of quotients is bounded
+ * by quotients of ends of dividend range. It never fails
+ */
+static void
+magic_range(const struct range *a, long long int magic, unsigned char aux,
+    struct range *r)
+{
+	long long int lo, hi;
+
+	lo = divide_magic(a->lo, magic, aux);
+	hi = divide_magic(a->hi, magic, aux);
+	r->lo = lo < hi ? lo : hi;
+	r->hi = lo < hi ? hi : lo;
+}
+
+/*
+ * Checked operation for both checked and unchecked opcode
+ */
+int
+checked_op(int op)
+{
+	switch (op) {
+	case OP_FADD:
+		return OP_ADD;
+	case OP_FSUB:
+		return OP_SUB;
+	case OP_FMUL:
+		return OP_MUL;
+	case OP_FDIV:
+		return OP_DIV;
+	default:
+		return op;
+	}
+}
+
+static int
+unchecked_op(int op)
+{
+	switch (op) {
+	case OP_ADD:
+		return OP_FADD;
+	case OP_SUB:
+		return OP_FSUB;
+	case OP_MUL:
+		return OP_FMUL;
+	case OP_DIV:
+		return OP_FDIV;
+	default:
+		return op;
+	}
+}
+
+/* Shortest chain of operations worth balancing */
+#define CHAIN_MIN	3
+
+/*
+ * Compiler turns a + b + c + d into chain of operations which wait
+ * for each other:
+ *	r2 = c + d; r1 = b + r2; r0 = a + r1
+ * Chain starting at ip is rewritten in place as balanced tree
+ *	r0 = a + b; r2 = c + d; r0 = r0 + r2
+ * when result is the same: operations wrap around modulo 2^64 or n,
+ * or none of partial results of either order can overflow. Operands
+ * stay in the same order. Returns 1 if chain was rewritten
+ */
+static int
+balance_chain(struct program *p, struct insn *ip, const struct range *ranges,
+    struct range **saved)
+{
+	struct insn *end = p->code + p->ncode, *last;
+	struct range *tmp, r;
+	int *leaf, op, m, n, base, regs = p->nlits + p->nvars, k, safe = 1;
+
+	op = checked_op(ip->op);
+	if (op != OP_ADD && op != OP_MUL && op != OP_MODADD &&
+	    op != OP_MODMUL)
+		return 0;
+	for (last = ip; last + 1 < end && checked_op(last[1].op) == op &&
+	    last[1].b == last->dst && last[1].dst == last->dst - 1 &&
+	    (saved == NULL || saved[last + 1 - p->code] == NULL); last++)
+		;
+	if ((m = last - ip + 1) < CHAIN_MIN || last->dst < regs)
+		return 0;
+	n = m + 1;
+	base = last->dst;
+
+	/* Leaf i is kept in register base + i, which is written later */
+	if ((leaf = reallocarray(NULL, n, sizeof(*leaf))) == NULL ||
+	    (tmp = reallocarray(NULL, n, sizeof(*tmp))) == NULL)
+		errx(1, "Couldn't allocate chain");
+	for (int i = 0; i < m; i++)
+		leaf[i] = ip[m - 1 - i].a;
+	leaf[m] = ip->b;
+	for (int i = 0; i < n; i++)
+		if (leaf[i] >= base && leaf[i] < base + m &&
+		    leaf[i] != base + i)
+			safe = 0;
+
+	if (safe && p->policy != POLICY_WRAP && op != OP_MODADD &&
+	    op != OP_MODMUL) {
+		r = ranges[leaf[m]];
+		for (int i = m - 1; i >= 0 && safe; i--)
+			safe = range_op(op, &ranges[leaf[i]], &r, &r);
+		for (int i = 0; i < n; i++)
+			tmp[i] = ranges[leaf[i]];
+		for (int s = 1; s < n && safe; s *= 2)
+			for (int i = 0; i + s < n && safe; i += 2 * s)
+				safe = range_op(op, &tmp[i], &tmp[i + s],
+				    &tmp[i]);
+	}
+
+	if (safe) {
+		k = 0;
+		for (int s = 1; s < n; s *= 2)
+			for (int i = 0; i + s < n; i += 2 * s) {
+				ip[k].op = op;
+				ip[k].dst = base + i;
+				ip[k].a = leaf[i];
+				ip[k].b = leaf[i + s];
+				leaf[i] = base + i;
+				k++;
+			}
+	}
+	free(leaf);
+	free(tmp);
+	return safe;
+}
+
+/*
+ * Ranges at the end of branch which jumps to instruction t are kept
+ * in saved[t] until the walk gets there, several branches may end at
+ * the same place. Array of them is allocated with the first jump
+ */
+static void
+save_ranges(struct range ***savedp, int t, const struct range *ranges,
+    int n, int ncode)
+{
+	struct range **saved, *s;
+
+	if (*savedp == NULL &&
+	    (*savedp = calloc(ncode + 1, sizeof(**savedp))) == NULL)
+		errx(1, "Couldn't allocate ranges");
+	saved = *savedp;
+	if ((s = saved[t]) == NULL) {
+		if ((s = reallocarray(NULL, n ? n : 1, sizeof(*s))) == NULL)
+			errx(1, "Couldn't allocate ranges");
+		memcpy(s, ranges, n * sizeof(*s));
+		saved[t] = s;
+		return;
+	}
+	for (int i = 0; i < n; i++) {
+		if (ranges[i].lo < s[i].lo)
+			s[i].lo = ranges[i].lo;
+		if (ranges[i].hi > s[i].hi)
+			s[i].hi = ranges[i].hi;
+	}
+}
+
+/*
+ * Analyze program, choosing checked or unchecked variant of every
+ * operation. Unchecked one is the same for every policy. May be
+ * called again after declared ranges change. Range of result is
+ * stored in *res if res isn't NULL.
+ *
+ * Chains of associative operations are balanced on the way, so they
+ * don't wait for each other.
+ *
+ * Instructions are walked in order. The second branch of conditional
+ * starts with ranges left by the first one, which is safe as branches
+ * only write registers above the condition. Where branches join,
+ * ranges of both are merged.
+ */
+void
+analyze_program(struct program *p, struct range *res)
+{
+	struct range *ranges, **saved = NULL, all = { LLONG_MIN, LLONG_MAX };
+	struct insn *ip;
+	int op;
+
+	if ((ranges = reallocarray(NULL, p->nframe ? p->nframe : 1,
+	    sizeof(*ranges))) == NULL)
+		errx(1, "Couldn't allocate ranges");
+	for (int i = 0; i < p->nlits; i++)
+		ranges[i].lo = ranges[i].hi = p->lits[i];
+	for (int i = 0; i < p->nvars; i++)
+		symbol_range(p->vars[i], &ranges[p->nlits + i]);
+	for (int i = p->nlits + p->nvars; i < p->nframe; i++)
+		ranges[i] = all;
+
+	for (ip = p->code; ip < p->code + p->ncode; ip++) {
+		if (saved != NULL && saved[ip - p->code] != NULL) {
+			save_ranges(&saved, ip - p->code, ranges, p->nframe,
+			    p->ncode);
+			memcpy(ranges, saved[ip - p->code],
+			    p->nframe * sizeof(*ranges));
+		}
+		balance_chain(p, ip, ranges, saved);
+		op = checked_op(ip->op);
+		if (op == OP_TRAP)
+			break;
+		if (op == OP_JZ)
+			continue;
+		if (op == OP_JMP) {
+			save_ranges(&saved, ip->dst, ranges, p->nframe,
+			    p->ncode);
+			continue;
+		}
+		if (op == OP_MOV) {
+			ranges[ip->dst] = ranges[ip->a];
+			continue;
+		}
+		if (op == OP_MDIV) {
+			magic_range(&ranges[ip->a], ranges[ip->b].lo, ip->aux,
+			    &ranges[ip->dst]);
+			continue;
+		}
+		if (range_op(op, &ranges[ip->a], &ranges[ip->b],
+		    &ranges[ip->dst]))
+			op = unchecked_op(op);
+		else if (p->policy == POLICY_WRAP)
+			ranges[ip->dst] = all; /* It didn't stop, but wrapped */
+		ip->op = op;
+	}
+
+	/* Branches may jump right to the end */
+	if (ip == p->code + p->ncode && saved != NULL &&
+	    saved[p->ncode] != NULL) {
+		save_ranges(&saved, p->ncode, ranges, p->nframe, p->ncode);
+		memcpy(ranges, saved[p->ncode], p->nframe * sizeof(*ranges));
+	}
+	if (res != NULL)
+		*res = p->result >= 0 ? ranges[p->result] : all;
+	for (int i = 0; saved != NULL && i <= p->ncode; i++)
+		free(saved[i]);
+	free(saved);
+	free(ranges);
+}
@@ -13,23 +13,15 @@
  * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
-#if defined(__OpenBSD__)
-#include <sys/queue.h>
-#include <err.h>
-#else
-#include "queue.h"
-#include <bsd/bsd.h>
-#endif
-
-
 #include <ctype.h>
+#include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <limits.h>
 
-enum token_type { TNUM, TOPR, TLBR, TRBR };
-/* Enum's from precedence will be appearing only on operator stack */
-enum precedence { SUB = 1, ADD = 2, DIV = 3, MUL = 4, LBR = -1};
+#include "argcalc.h"
+
 enum { MIN_ARGS = 3};
 
 struct token_list {
@@ -55,18 +47,12 @@ struct rpn_queue {
 
 SIMPLEQ_HEAD(, rpn_queue) rpn_queue_head;
 
-struct eval_stack {
-	SLIST_ENTRY(eval_stack) next;
-	long long int num;
-};
-
-SLIST_HEAD(, eval_stack) eval_stack_head;
-
 /*
  *  Add token which is either number, operator, left brace or right brace
  *  to token simple queue containing all tokens
- *  type is token type, load is number if token_type is TNUM or
- *  precedence if it is operator or left brace
+ *  type is token type, load is number if token_type is TNUM,
+ *  symbol index if it is TVAR or precedence if it is operator or
+ *  left brace
  */
 void
 add_token_to_list(int t_type, long long int load)
@@ -156,282 +142,955 @@ pop_from_operator_stack(void)
 }
 
 /*
- * Push number to evaluation stack used to calculate expression
+ * Names of variables met in expressions. Symbol index is used as
+ * token payload and as variable index in compiled programs. Open
+ * addressed hash table of buckets keeps symbol index plus one, 0 is
+ * empty bucket, and has at least twice as many buckets as symbols
  */
-void
-push_to_eval_stack(long long int num)
-{
-	struct eval_stack *node;
+static char **symbols;
+static int nsymbols;
+static int symbols_size;
+static int *buckets;
+static size_t nbuckets;
 
-	if ((node = malloc(sizeof(*node))) == NULL)
-		errx(1, "Couldnt allocate evaluation stack node");
+/* FNV-1a, like hash_tokens */
+static size_t
+hash_name(const char *name, size_t len)
+{
+	unsigned long long h = 0xcbf29ce484222325ULL;
 
-	node->num = num;
-	SLIST_INSERT_HEAD(&eval_stack_head, node, next);
+	for (size_t i = 0; i < len; i++)
+		h = (h ^ (unsigned char)name[i]) * 0x100000001b3ULL;
+	return h;
 }
 
 /*
- * Pop number from evaluation stack. If stack is empty write error
- * that tell's that there is inconsistent number of operators
+ * Return bucket of symbol with name of len characters, or empty bucket
+ * where it goes
  */
-long long int
-pop_from_eval_stack(void)
+static size_t
+find_bucket(const char *name, size_t len)
 {
-	long long int num;
-	struct eval_stack *node;
+	size_t b = hash_name(name, len) & (nbuckets - 1);
+	const char *s;
 
-	if (SLIST_EMPTY(&eval_stack_head))
-		errx(1, "Inconsistent number of operators");
-
-	node = SLIST_FIRST(&eval_stack_head);
-	num = node->num;
-	SLIST_REMOVE_HEAD(&eval_stack_head, next);
-	free(node);
+	for (; buckets[b] != 0; b = (b + 1) & (nbuckets - 1)) {
+		s = symbols[buckets[b] - 1];
+		if (strncmp(s, name, len) == 0 && s[len] == '\0')
+			break;
+	}
+	return b;
+}
 
-	return num;
+/*
+ * Double number of buckets and put symbols into them again
+ */
+static void
+grow_buckets(void)
+{
+	free(buckets);
+	nbuckets = nbuckets ? nbuckets * 2 : 32;
+	if ((buckets = calloc(nbuckets, sizeof(*buckets))) == NULL)
+		errx(1, "Couldn't grow symbol table");
+	for (int i = 0; i < nsymbols; i++)
+		buckets[find_bucket(symbols[i], strlen(symbols[i]))] = i + 1;
 }
 
 /*
- * substract operand_second from operand_first
- * This should report error if overflow occurs
+ * Return index of symbol with name of len characters, adding it to
+ * symbol table if it isn't there yet
  */
-long long int
-substract(long long int op_first, long long int op_second)
+int
+intern_symbol(const char *name, size_t len)
 {
-	long long int res;
+	char **n;
+	size_t b;
 
-	if ((op_second > 0 && op_first < LONG_MIN + op_second) ||
-	    (op_second < 0 && op_first > LONG_MAX + op_second)) {
-		errx(1, "Integer overflow");
-	} else {
-		res = op_first - op_second;
+	if ((size_t)nsymbols * 2 >= nbuckets)
+		grow_buckets();
+	if (buckets[b = find_bucket(name, len)] != 0)
+		return buckets[b] - 1;
+
+	if (nsymbols == symbols_size) {
+		symbols_size = symbols_size ? symbols_size * 2 : 16;
+		if ((n = reallocarray(symbols, symbols_size,
+		    sizeof(*symbols))) == NULL)
+			errx(1, "Couldn't grow symbol table");
+		symbols = n;
 	}
-	return res;
+	if ((symbols[nsymbols] = strndup(name, len)) == NULL)
+		errx(1, "Couldn't allocate symbol");
+	buckets[b] = nsymbols + 1;
+
+	return nsymbols++;
+}
+
+const char *
+symbol_name(int sym)
+{
+	return symbols[sym];
+}
+
+int
+symbol_count(void)
+{
+	return nsymbols;
 }
 
 /*
- * Addup operand_second to operand_first
- * This should report error if overflow occurs
- * and it is reporting it
+ * Check if word is name of variable: letter or underscore followed by
+ * letters, digits and underscores
  */
-long long int
-addup(long long int op_first, long long int op_second)
+static int
+is_identifier(const char *word)
 {
-	long long int res;
-	if (((op_second > 0) && (op_first > (LONG_MAX - op_second))) ||
-	    ((op_second < 0) && (op_first < (LONG_MIN - op_second)))) {
-		errx(1, "Integer overflow");
-	} else {
-		res = op_first + op_second;
+	if (!isalpha((unsigned char)word[0]) && word[0] != '_')
+		return 0;
+	for (int j = 1; word[j] != '\0'; j++)
+		if (!isalnum((unsigned char)word[j]) && word[j] != '_')
+			return 0;
+	return 1;
+}
+
+/*
+ * Check if word is decimal number: digits with at most one point
+ */
+static int
+is_decimal(const char *word)
+{
+	int digits = 0, points = 0;
+
+	for (int j = 0; word[j] != '\0'; j++) {
+		if (word[j] == '.')
+			points++;
+		else if (isdigit((unsigned char)word[j]))
+			digits++;
+		else
+			return 0;
 	}
-	return res;
+	return digits > 0 && points <= 1;
+}
+
+static void
+put_token(struct token *out, int *n, int type, long long int payload)
+{
+	out[*n].type = type;
+	out[*n].payload = payload;
+	(*n)++;
 }
 
 /*
- * Multiply two numbers: op_first and op_second and
- * handle all possible overflow errors
+ * Turn charaters of one word of expression into at most strlen(word)
+ * tokens stored in out, their number is stored in *n. Name of variable
+ * becomes TVAR without symbol, so this may run on any thread. Returns
+ * NULL or error string from strtonum if word is number which doesn't
+ * fit. With decimal scale numbers may have point and are scaled
  */
-long long int
-multiply(long long int op_first, long long int op_second)
-{
-	long long int res;
-
-	if (op_first > 0) { /* op_first is positive */
-		if (op_second > 0) { /* op_first and op_second is positive */
-			if (op_first > (LONG_MAX / op_second)) {
-				errx(1, "Integer overflow");
-			} else { /* op_first is positive op_second is not */
-				if (op_second < (LONG_MIN / op_first)) {
-					errx(1, "Integer overflow");
-				}
-			}
-		} /* op_first is positive, op_second nonpositive */
-	} else { /* op_first is nonpositive */
-		if (op_second > 0) { /* op_first is nonpositive, op_second is positive */
-			if (op_first < (LONG_MIN / op_second)) {
-				errx(1, "Integer overflow");
+const char *
+scan_word(const char *word, struct token *out, int *n)
+{
+	int is_digit = 0;
+	const char *errstr = NULL;
+	long long int num;
+
+	*n = 0;
+	if (is_identifier(word)) {
+		put_token(out, n, TVAR, -1);
+		return NULL;
+	}
+	if (get_scale() > 0 && is_decimal(word)) {
+		if ((errstr = parse_decimal(word, get_scale(), &num)) == NULL)
+			put_token(out, n, TNUM, num);
+		return errstr;
+	}
+
+	for (int j = 0; word[j] != '\0'; j++) {
+		switch (word[j]) {
+		case '*':
+			put_token(out, n, TOPR, MUL);
+			is_digit = 0;
+			break;
+		case '/':
+			put_token(out, n, TOPR, DIV);
+			is_digit = 0;
+			break;
+		case '+':
+			put_token(out, n, TOPR, ADD);
+			is_digit = 0;
+			break;
+		case '-':
+			put_token(out, n, TOPR, SUB);
+			is_digit = 0;
+			break;
+		case '(':
+			put_token(out, n, TLBR, LBR);
+			is_digit = 0;
+			break;
+		case ')':
+			put_token(out, n, TRBR, 0);
+			is_digit = 0;
+			break;
+		case '{':
+			put_token(out, n, TLBR, LBR);
+			is_digit = 0;
+			break;
+		case '}':
+			put_token(out, n, TRBR, 0);
+			is_digit = 0;
+			break;
+		case '<':
+		case '>':
+			if (word[j + 1] == '=') {
+				put_token(out, n, TOPR,
+				    word[j] == '<' ? LE : GE);
+				j++;
+			} else
+				put_token(out, n, TOPR,
+				    word[j] == '<' ? LT : GT);
+			is_digit = 0;
+			break;
+		case '=':
+		case '!':
+			/* Only == and != */
+			if (word[j + 1] == '=') {
+				put_token(out, n, TOPR,
+				    word[j] == '=' ? EQ : NE);
+				j++;
 			}
-		} else { /* op_first and op_second is nonpositive */
-			if ((op_first != 0) &&
-			    (op_second < (LONG_MAX / op_first))) {
-				errx(1, "Integer overflow");
+			is_digit = 0;
+			break;
+		case '&':
+		case '|':
+			/* Only && and || */
+			if (word[j + 1] == word[j]) {
+				put_token(out, n, TOPR,
+				    word[j] == '&' ? AND : OR);
+				j++;
 			}
-		} /* End if op_first and op_second are nonpositive */
-	} /* End if op_first is nonpositive */
+			is_digit = 0;
+			break;
+		case '?':
+			put_token(out, n, TQST, QST);
+			is_digit = 0;
+			break;
+		case ':':
+			put_token(out, n, TCOL, COL);
+			is_digit = 0;
+			break;
+		default:
+		/*
+		 * Set is_digit != 0 if all charaters in word
+		 * are digits.
+		 */
+			if (j == 0 || is_digit != 0)
+				is_digit = isdigit((unsigned char)word[j]);
+			else
+				is_digit = 0;
+			break;
+		}
+	}
+	if (is_digit) {
+		num = strtonum(word, LONG_MIN, LONG_MAX, &errstr);
+		if (errstr == NULL)
+			put_token(out, n, TNUM, num);
+	}
 
-	res = op_first * op_second;
-	return res;
+	return errstr;
 }
 
 /*
- * Devide op_first by op_second and handle if present
+ * Turn charaters of one word of expression into tokens, see scan_word
  */
-long long int
-devide(long long int op_first, long long int op_second)
+const char *
+tokenize_word(const char *word)
 {
+	static struct token *scratch;
+	static size_t scratch_size;
+	struct token *t;
+	const char *errstr;
+	size_t len = strlen(word);
+	int n;
 
-	long long int res;
+	if (len + 1 > scratch_size) {
+		if ((t = reallocarray(scratch, len + 1, sizeof(*t))) == NULL)
+			errx(1, "Couldn't allocate tokens");
+		scratch = t;
+		scratch_size = len + 1;
+	}
+	errstr = scan_word(word, scratch, &n);
+	for (int i = 0; i < n; i++)
+		add_token_to_list(scratch[i].type, scratch[i].type == TVAR ?
+		    intern_symbol(word, len) : scratch[i].payload);
+	return errstr;
+}
+
+/*
+ * Drop everything left in token list, operator stack and RPN queue
+ * after expression which failed to parse
+ */
+void
+free_tokens(void)
+{
+	struct token_list *token_node;
+	struct rpn_queue *rpn_node;
 
-	if (op_second == 0)
-		errx(1, "Division by zero");
+	while (!SIMPLEQ_EMPTY(&token_list_head)) {
+		token_node = SIMPLEQ_FIRST(&token_list_head);
+		SIMPLEQ_REMOVE_HEAD(&token_list_head, next);
+		free(token_node);
+	}
+	while (!SLIST_EMPTY(&operator_stack_head))
+		pop_from_operator_stack();
+	while (!SIMPLEQ_EMPTY(&rpn_queue_head)) {
+		rpn_node = SIMPLEQ_FIRST(&rpn_queue_head);
+		SIMPLEQ_REMOVE_HEAD(&rpn_queue_head, next);
+		free(rpn_node);
+	}
+}
 
-	if ((op_first == LONG_MIN) && (op_second == -1))
-		errx(1, "Integer overflow");
+/*
+ * Number one in current mode, true value of logical operators
+ */
+static long long int
+one(void)
+{
+	long long int num = 1;
 
-	res = op_first / op_second;
-	return res;
+	parse_decimal("1", get_scale(), &num);
+	return num;
 }
 
 /*
- * ARGument CALCulator
- * Evaluate infix expression supplied as command line
- * arguments as expr does it
+ * Store into out tokens which operator popped from operator stack
+ * becomes in RPN queue, at most MAX_LOWERED of them. Left operand of
+ * logical operator is already followed by TIF, so they become
+ *	a && b	a TIF b 0 != TELSE 0 TEND
+ *	a || b	a TIF 1 TELSE b 0 != TEND
+ * and right operand is never evaluated if left one decides result.
+ * Returns number of tokens or -1 for '?' without ':'
  */
 int
-main(int argc, char **argv)
+lower_operator(int operator, struct token *out)
 {
+	int n = 0;
 
-	int is_digit;
-	const char *errstr;
+	switch (operator) {
+	case QST:
+		return -1;
+	case COL:
+		put_token(out, &n, TEND, 0);
+		break;
+	case AND:
+		put_token(out, &n, TNUM, 0);
+		put_token(out, &n, TOPR, NE);
+		put_token(out, &n, TELSE, 0);
+		put_token(out, &n, TNUM, 0);
+		put_token(out, &n, TEND, 0);
+		break;
+	case OR:
+		put_token(out, &n, TNUM, 0);
+		put_token(out, &n, TOPR, NE);
+		put_token(out, &n, TEND, 0);
+		break;
+	default:
+		put_token(out, &n, TOPR, operator);
+		break;
+	}
 
-	SIMPLEQ_INIT(&token_list_head);
-	SLIST_INIT(&operator_stack_head);
-	SIMPLEQ_INIT(&rpn_queue_head);
-	SLIST_INIT(&eval_stack_head);
+	return n;
+}
 
-	struct token_list *token_node;
-	struct rpn_queue *rpn_node;
+/*
+ * Store into out tokens which follow operator pushed to operator
+ * stack, at most MAX_LOWERED of them. Left operand of logical operator
+ * and conditional is complete, so they branch on it. Returns number
+ * of tokens
+ */
+int
+branch_operator(int operator, struct token *out)
+{
+	int n = 0;
 
-	int operator;
-	long long int operand_first;
-	long long int operand_second;
-	long long int operand_result;
+	if (operator == AND || operator == OR || operator == QST)
+		put_token(out, &n, TIF, 0);
+	if (operator == OR) {
+		put_token(out, &n, TNUM, one());
+		put_token(out, &n, TELSE, 0);
+	}
+	return n;
+}
 
-	/* Turn charaters from command line arguments into tokens */
-	for (int i = 1; i < argc && argc > MIN_ARGS; i++) {
-		for (int j = 0; argv[i][j] != '\0'; j++) {
-			switch (argv[i][j]) {
-			case '*':
-				add_token_to_list(TOPR, MUL);
-				is_digit = 0;
-				break;
-			case '/':
-				add_token_to_list(TOPR, DIV);
-				is_digit = 0;
-				break;
-			case '+':
-				add_token_to_list(TOPR, ADD);
-				is_digit = 0;
-				break;
-			case '-':
-				add_token_to_list(TOPR, SUB);
-				is_digit = 0;
-				break;
-			case '(':
-				add_token_to_list(TLBR, LBR);
-				is_digit = 0;
-				break;
-			case ')':
-				add_token_to_list(TRBR, 0);
-				is_digit = 0;
-				break;
-			case '{':
-				add_token_to_list(TLBR, LBR);
-				is_digit = 0;
-				break;
-			case '}':
-				add_token_to_list(TRBR, 0);
-				is_digit = 0;
-				break;
-			default:
-			/*
-			 * Set is_digit != 0 if all charaters in argv[i]
-			 * are digits.
-			 */
-				if (j == 0 || is_digit != 0)
-					is_digit = isdigit(argv[i][j]);
-				else
-					is_digit = 0;
-				break;
-			}
-		}
-		if (is_digit){
-			add_token_to_list(TNUM, strtonum(argv[i],\
-				 LONG_MIN, LONG_MAX, &errstr));
-			if (errstr != NULL)
-				errx(1, "number \"%s\" is %s", argv[i], errstr); 
-		}		
+/*
+ * Comparisons bind in two tiers, < > <= >= tighter than == !=, and
+ * associate to the left as in C. Other operators bind by their own
+ * precedence
+ */
+static int
+tier(int operator)
+{
+	if (operator <= GE && operator >= LT)
+		return LT;
+	if (operator == NE)
+		return EQ;
+	return operator;
+}
 
+/*
+ * Operator top from operator stack goes to RPN queue before operator
+ * is pushed
+ */
+int
+pops_before(int top, int operator)
+{
+	if (operator <= GE && operator >= EQ)
+		return tier(top) >= tier(operator);
+	return top > operator;
+}
 
-	}
+/*
+ * Move operator from operator stack to RPN queue. Returns error code
+ */
+static int
+pop_to_queue(void)
+{
+	struct token t[MAX_LOWERED];
+	int n;
 
-	/* Translate infix expression into reverse polish notation */
-	while (!SIMPLEQ_EMPTY(&token_list_head)) {
+	if ((n = lower_operator(pop_from_operator_stack(), t)) == -1)
+		return CALC_CONDITIONAL; /* '?' without ':' */
+	for (int i = 0; i < n; i++)
+		add_token_to_queue(t[i].type, t[i].payload);
+
+	return CALC_OK;
+}
+
+/*
+ * Translate infix expression from token list into reverse polish
+ * notation queue using sorting yard algorithm
+ */
+int
+shunting_yard(void)
+{
+	struct token_list *token_node;
+	struct token t[MAX_LOWERED];
+	int error = CALC_OK, n;
+
+	while (!SIMPLEQ_EMPTY(&token_list_head) && error == CALC_OK) {
 		token_node = SIMPLEQ_FIRST(&token_list_head);
-		if (token_node->token_type == TNUM)
-			add_token_to_queue(TNUM, token_node->payload);
-		else if (token_node->token_type == TOPR) {
-			while (peek_from_operator_stack() > token_node->payload)
-				add_token_to_queue(TOPR,
-				    pop_from_operator_stack());
+		if (token_node->token_type == TNUM ||
+		    token_node->token_type == TVAR)
+			add_token_to_queue(token_node->token_type,
+			    token_node->payload);
+		else if (token_node->token_type == TOPR ||
+		    token_node->token_type == TQST) {
+			while (pops_before(peek_from_operator_stack(),
+			    token_node->payload) && error == CALC_OK)
+				error = pop_to_queue();
 			push_to_operator_stack(token_node->payload);
+			n = branch_operator(token_node->payload, t);
+			for (int i = 0; i < n; i++)
+				add_token_to_queue(t[i].type, t[i].payload);
+		} else if (token_node->token_type == TCOL) {
+			while (peek_from_operator_stack() != QST &&
+			    peek_from_operator_stack() != LBR &&
+			    error == CALC_OK)
+				error = pop_to_queue();
+			if (error == CALC_OK &&
+			    peek_from_operator_stack() != QST)
+				error = CALC_CONDITIONAL; /* ':' without '?' */
+			if (error == CALC_OK) {
+				pop_from_operator_stack();
+				push_to_operator_stack(COL);
+				add_token_to_queue(TELSE, 0);
+			}
 		} else if (token_node->token_type == TLBR) {
 			push_to_operator_stack(LBR);
 		} else if (token_node->token_type == TRBR) {
-			while (peek_from_operator_stack() != LBR)
-				add_token_to_queue(TOPR,
-				    pop_from_operator_stack());
+			while (peek_from_operator_stack() != LBR &&
+			    error == CALC_OK)
+				error = pop_to_queue();
+			if (error == CALC_OK &&
+			    SLIST_EMPTY(&operator_stack_head))
+				error = CALC_BRACKET;
 		/* Pop the left bracket from the stack and discard it */
-			pop_from_operator_stack();
+			if (error == CALC_OK)
+				pop_from_operator_stack();
 		}
 		SIMPLEQ_REMOVE_HEAD(&token_list_head, next);
 		free(token_node);
 	}
-	while (!SLIST_EMPTY(&operator_stack_head)) {
-		add_token_to_queue(TOPR, pop_from_operator_stack());
+	while (!SLIST_EMPTY(&operator_stack_head) && error == CALC_OK)
+		error = pop_to_queue();
+
+	if (error != CALC_OK)
+		free_tokens();
+	return error;
+}
+
+/*
+ * Split len characters of s into words separated by white space and
+ * turn them into tokens, same as words of command line
+ */
+int
+tokenize_expression(const char *s, size_t len)
+{
+	char *buf, *word, *end;
+
+	if ((buf = malloc(len + 1)) == NULL)
+		errx(1, "Couldn't allocate expression");
+	memcpy(buf, s, len);
+	buf[len] = '\0';
+
+	for (word = buf; *word != '\0'; word = end) {
+		while (isspace((unsigned char)*word))
+			word++;
+		if (*word == '\0')
+			break;
+		for (end = word; *end != '\0' &&
+		    !isspace((unsigned char)*end); end++)
+			;
+		if (*end != '\0')
+			*end++ = '\0';
+		if (tokenize_word(word) != NULL) {
+			free(buf);
+			free_tokens();
+			return CALC_RANGE;
+		}
 	}
+	free(buf);
+
+	return CALC_OK;
+}
+
+/*
+ * Turn len characters of s into RPN queue
+ */
+int
+parse_expression(const char *s, size_t len)
+{
+	int error;
+
+	if ((error = tokenize_expression(s, len)) != CALC_OK)
+		return error;
+	return shunting_yard();
+}
 
-	/* Evaluate RPN expression using stack */
+static int
+compare_op(int operator)
+{
+	switch (operator) {
+	case LT:
+		return OP_LT;
+	case GT:
+		return OP_GT;
+	case LE:
+		return OP_LE;
+	case GE:
+		return OP_GE;
+	case EQ:
+		return OP_EQ;
+	default:
+		return OP_NE;
+	}
+}
+
+/*
+ * Compile one token of reverse polish notation
+ */
+void
+compile_token(struct compiler *cc, int type, long long int payload)
+{
+	int decimal = cc->prog->scale > 0, modular = cc->prog->mod.n != 0;
+	int rational = cc->prog->rational != RATIONAL_NONE;
+
+	if (type == TNUM)
+		cc_num(cc, payload);
+	else if (type == TVAR)
+		cc_var(cc, payload);
+	else if (type == TIF)
+		cc_if(cc);
+	else if (type == TELSE)
+		cc_else(cc);
+	else if (type == TEND)
+		cc_endif(cc);
+	else if (type == TOPR && payload <= GE && payload >= EQ) {
+		cc_op(cc, compare_op(payload));
+		/* Comparison gives 1, which is one only for integers */
+		if (decimal || modular) {
+			cc_num(cc, one());
+			cc_op(cc, OP_FMUL);
+		}
+	} else if (type == TOPR) {
+		switch (payload) {
+		case SUB:
+			cc_op(cc, modular ? OP_MODSUB :
+			    rational ? OP_QSUB : OP_SUB);
+			break;
+		case ADD:
+			cc_op(cc, modular ? OP_MODADD :
+			    rational ? OP_QADD : OP_ADD);
+			break;
+		case DIV:
+			cc_op(cc, modular ? OP_MODDIV : rational ? OP_QDIV :
+			    decimal ? OP_DDIV : OP_DIV);
+			break;
+		case MUL:
+			cc_op(cc, modular ? OP_MODMUL : rational ? OP_QMUL :
+			    decimal ? OP_DMUL : OP_MUL);
+			break;
+		case LBR:
+			cc_drop(cc);
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+/*
+ * Compile reverse polish notation queue into program for evaluator,
+ * freeing the queue. Program is analyzed, so checks which can't fail
+ * are dropped and chains of operations are balanced
+ */
+void
+compile_rpn(struct program *prog)
+{
+	struct compiler cc;
+	struct rpn_queue *rpn_node;
+
+	cc_init(&cc, prog);
 	while (!SIMPLEQ_EMPTY(&rpn_queue_head)) {
 		rpn_node = SIMPLEQ_FIRST(&rpn_queue_head);
-		if (rpn_node->token_type == TNUM)
-			push_to_eval_stack(rpn_node->payload);
-		else if (rpn_node->token_type == TOPR) {
-			operator = rpn_node->payload;
-	/* We should get second operand first because we use stack */
-			operand_second = pop_from_eval_stack();
-			operand_first = pop_from_eval_stack();
-			switch (operator) {
-			case SUB:
-				operand_result = substract(operand_first,
-				    operand_second);
-				push_to_eval_stack(operand_result);
-				break;
-			case ADD:
-				operand_result = addup(operand_first,
-				    operand_second);
-				push_to_eval_stack(operand_result);
-				break;
-			case DIV:
-				operand_result = devide(operand_first,
-				    operand_second);
-				push_to_eval_stack(operand_result);
-				break;
-			case MUL:
-				operand_result = multiply(operand_first,
-				    operand_second);
-				push_to_eval_stack(operand_result);
-				break;
-			default:
-				break;
-			}
-		}
+		compile_token(&cc, rpn_node->token_type, rpn_node->payload);
 		SIMPLEQ_REMOVE_HEAD(&rpn_queue_head, next);
 		free(rpn_node);
 	}
+	cc_finish(&cc);
+	analyze_program(prog, NULL);
+}
+
+/*
+ * Hash normalized token stream, which is the same for expressions
+ * differing only in spaces or kind of brackets. Second independent
+ * hash is stored to check. Current policy, scale and modulus are
+ * hashed too. Returns 0 if expression refers to variables and its
+ * result can't be reused
+ */
+unsigned long long
+hash_tokens(unsigned long long *check)
+{
+	struct token_list *node;
+	unsigned long long h = 0xcbf29ce484222325ULL, c = 0, x;
+
+	/* Results of other modes differ, integer checked stay as they were */
+	if (get_policy() != POLICY_CHECKED || get_scale() != 0 ||
+	    get_modulus() != 0) {
+		h = (h ^ get_policy() ^ get_scale() << 8) * 0x100000001b3ULL;
+		h = (h ^ get_modulus()) * 0x100000001b3ULL;
+		c = get_policy() | get_scale() << 8 | get_modulus() << 16;
+	}
+	SIMPLEQ_FOREACH(node, &token_list_head, next) {
+		if (node->token_type == TVAR)
+			return 0;
+		/* FNV-1a over token type and payload */
+		h = (h ^ node->token_type) * 0x100000001b3ULL;
+		h = (h ^ (unsigned long long)node->payload) * 0x100000001b3ULL;
+		/* splitmix64 finalizer chained over tokens */
+		x = c + (unsigned long long)node->payload +
+		    node->token_type * 0x9e3779b97f4a7c15ULL;
+		x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+		c = (c << 7 | c >> 57) ^ x ^ (x >> 31);
+	}
+	*check = c;
+
+	return h != 0 ? h : 1;
+}
+
+/*
+ * Translate tokens into RPN, compile and run it. has_result is set
+ * if expression has produced value, which is rational result/den if
+ * numbers are rationals
+ */
+static int
+evaluate_tokens(long long int *result, long long int *den, int *has_result)
+{
+	struct program prog;
+	long long int *frame;
+	int error;
+
+	*has_result = 0;
+	/* Translate infix expression into reverse polish notation */
+	if ((error = shunting_yard()) != CALC_OK)
+		return error;
+
+	/* Evaluate RPN expression compiled into register program */
+	compile_rpn(&prog);
+	if (prog.nvars > 0)
+		errx(1, "Unknown variable %s", symbol_name(prog.vars[0]));
+	frame = frame_alloc(&prog);
+	if ((error = run_program(&prog, frame, result)) == CALC_OK)
+		*has_result = prog.result >= 0;
+	if (*has_result && prog.rational)
+		*den = frame[prog.nframe + prog.result];
+
+	free(frame);
+	free_program(&prog);
+	return error;
+}
 
-	if (!SLIST_EMPTY(&eval_stack_head))
-		printf("%lld \n", pop_from_eval_stack());
+/*
+ * Parse "name=lo:hi" into symbol of variable name and range ends,
+ * which are decimals of current scale
+ */
+static void
+parse_range(char *spec, int *sym, long long int *lo, long long int *hi)
+{
+	char *eq, *colon;
+	const char *errstr;
+
+	if ((eq = strchr(spec, '=')) == NULL ||
+	    (colon = strchr(eq, ':')) == NULL)
+		errx(1, "range \"%s\" is not name=lo:hi", spec);
+	*eq = *colon = '\0';
+	if (!is_identifier(spec))
+		errx(1, "\"%s\" is not a variable name", spec);
+	if ((errstr = parse_decimal(eq + 1, get_scale(), lo)) != NULL)
+		errx(1, "range start \"%s\" is %s", eq + 1, errstr);
+	if ((errstr = parse_decimal(colon + 1, get_scale(), hi)) != NULL)
+		errx(1, "range end \"%s\" is %s", colon + 1, errstr);
+	if (*hi < *lo)
+		errx(1, "range end \"%s\" is too small", colon + 1);
+	*sym = intern_symbol(spec, strlen(spec));
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: argcalc [-d scale | -M modulus] [-p policy] "
+	    "[-c cache] expression\n"
+	    "       argcalc -q form [-j jobs] [-e file | expression]\n"
+	    "       argcalc [-d scale] [-p policy] [-j jobs] -S name=lo:hi "
+	    "[-a list] expression\n"
+	    "       argcalc [-d scale | -M modulus] [-p policy] [-j jobs] "
+	    "-e file [-o image]\n"
+	    "       argcalc -x image [name=value ...]\n"
+	    "       argcalc [-d scale | -M modulus] [-p policy] [-w] "
+	    "[-r name=lo:hi ...] -f file\n"
+	    "       argcalc [-d scale | -M modulus] [-p policy] -b [-m [-s]] "
+	    "[-j jobs]\n");
+	exit(1);
+}
+
+/*
+ * ARGument CALCulator
+ * Evaluate infix expression supplied as command line
+ * arguments as expr does it
+ */
+int
+main(int argc, char **argv)
+{
+	static const struct option longopts[] = {
+		{ "aggregate",	required_argument,	NULL,	'a' },
+		{ "batch",	no_argument,		NULL,	'b' },
+		{ "cache",	required_argument,	NULL,	'c' },
+		{ "decimal",	required_argument,	NULL,	'd' },
+		{ "expression",	required_argument,	NULL,	'e' },
+		{ "file",	required_argument,	NULL,	'f' },
+		{ "jobs",	required_argument,	NULL,	'j' },
+		{ "memo",	no_argument,		NULL,	'm' },
+		{ "image",	required_argument,	NULL,	'x' },
+		{ "mod",	required_argument,	NULL,	'M' },
+		{ "output",	required_argument,	NULL,	'o' },
+		{ "policy",	required_argument,	NULL,	'p' },
+		{ "range",	required_argument,	NULL,	'r' },
+		{ "rational",	required_argument,	NULL,	'q' },
+		{ "stats",	no_argument,		NULL,	's' },
+		{ "sweep",	required_argument,	NULL,	'S' },
+		{ "watch",	no_argument,		NULL,	'w' },
+		{ NULL,		0,			NULL,	0 }
+	};
+	const char *errstr;
+	const char *file = NULL, *cache_path = NULL, *expression = NULL;
+	const char *aggregates = NULL, *output = NULL, *image = NULL;
+	char *sweep = NULL;
+	int ch, watch = 0, batch = 0, jobs = 0, memo = 0, stats = 0;
+	int policy, form, nranges = 0, sym;
+	long long int modulus, lo, hi;
+	char **ranges;
+
+	SIMPLEQ_INIT(&token_list_head);
+	SLIST_INIT(&operator_stack_head);
+	SIMPLEQ_INIT(&rpn_queue_head);
+
+	struct cache *cache = NULL;
+	unsigned long long key = 0, check;
+	long long int result, den = 1;
+	int error, has_result;
+	char buf[48];
+
+	if ((ranges = calloc(argc, sizeof(*ranges))) == NULL)
+		errx(1, "Couldn't allocate ranges");
+
+	/* Options go before expression, so "-" is never mistaken for one */
+	while ((ch = getopt_long(argc, argv, "+M:S:a:bc:d:e:f:j:mo:p:q:r:swx:",
+	    longopts, NULL)) != -1) {
+		switch (ch) {
+		case 'M':
+			modulus = strtonum(optarg, 2, LLONG_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "modulus \"%s\" is %s", optarg, errstr);
+			set_modulus(modulus);
+			break;
+		case 'S':
+			sweep = optarg;
+			break;
+		case 'a':
+			aggregates = optarg;
+			break;
+		case 'b':
+			batch = 1;
+			break;
+		case 'c':
+			cache_path = optarg;
+			break;
+		case 'd':
+			set_scale(strtonum(optarg, 0, MAX_SCALE, &errstr));
+			if (errstr != NULL)
+				errx(1, "scale \"%s\" is %s", optarg, errstr);
+			break;
+		case 'e':
+			expression = optarg;
+			break;
+		case 'f':
+			file = optarg;
+			break;
+		case 'j':
+			jobs = strtonum(optarg, 1, 256, &errstr);
+			if (errstr != NULL)
+				errx(1, "jobs \"%s\" is %s", optarg, errstr);
+			break;
+		case 'm':
+			memo = 1;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'p':
+			if ((policy = policy_from_name(optarg)) == -1)
+				errx(1, "unknown policy \"%s\"", optarg);
+			set_policy(policy);
+			break;
+		case 'q':
+			if ((form = rational_from_name(optarg)) == -1)
+				errx(1, "unknown form \"%s\"", optarg);
+			set_rational(form);
+			break;
+		case 'r':
+			ranges[nranges++] = optarg;
+			break;
+		case 's':
+			stats = 1;
+			break;
+		case 'w':
+			watch = 1;
+			break;
+		case 'x':
+			image = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (get_scale() != 0 && get_modulus() != 0)
+		errx(1, "decimals can't be residues");
+	if (get_modulus() != 0 && nranges > 0)
+		errx(1, "residues can't have ranges");
+	if (get_modulus() != 0 && sweep != NULL)
+		errx(1, "residues can't be swept");
+	if (get_rational() != RATIONAL_NONE) {
+		if (get_scale() != 0 || get_modulus() != 0)
+			errx(1, "rationals can't be decimals or residues");
+		if (get_policy() != POLICY_CHECKED)
+			errx(1, "rationals can't wrap or saturate");
+		/* Everything else keeps one number for every value */
+		if (file != NULL || batch || output != NULL || image != NULL ||
+		    sweep != NULL)
+			errx(1, "rationals are only for single expression");
+	}
+
+	/* Only memo finds repeats to count */
+	if (stats && !memo)
+		usage();
+
+	/* Nothing else checks values against ranges, see analyze.c */
+	if (nranges > 0 && file == NULL)
+		usage();
+
+	/* Ranges are read when scale is known */
+	for (int i = 0; i < nranges; i++) {
+		parse_range(ranges[i], &sym, &lo, &hi);
+		declare_range(sym, lo, hi);
+	}
+
+	if (file != NULL)
+		return run_cells(file, watch);
+	if (batch)
+		return run_batch(jobs, memo, stats);
+	if (expression != NULL && output != NULL && !watch && !memo && !stats)
+		return compile_image(expression, jobs, output);
+	if (expression != NULL && !watch && !memo && !stats)
+		return run_expression(expression, jobs);
+	if (image != NULL && !watch && !memo && !stats && jobs == 0)
+		return run_image(image, argc, argv);
+	if (watch || memo || stats || output != NULL ||
+	    (jobs > 0 && sweep == NULL) ||
+	    (aggregates != NULL && sweep == NULL))
+		usage();
+
+	if (cache_path == NULL)
+		cache_path = getenv("ARGCALC_CACHE");
+	/* Cache keeps one number, not fraction */
+	if (cache_path != NULL && *cache_path != '\0' &&
+	    get_rational() == RATIONAL_NONE)
+		cache = cache_open(cache_path);
+
+	/* Turn charaters from command line arguments into tokens */
+	for (int i = 0; i < argc && (argc >= MIN_ARGS || sweep != NULL); i++) {
+		if ((errstr = tokenize_word(argv[i])) != NULL)
+			errx(1, "number \"%s\" is %s", argv[i], errstr);
+	}
+
+	/* Range of swept variable helps to analyze expression */
+	if (sweep != NULL) {
+		parse_range(sweep, &sym, &lo, &hi);
+		declare_range(sym, lo, hi);
+		return run_sweep(sym, lo, hi, jobs, aggregates);
+	}
+
+	/* Cached result makes parsing and evaluation unnecessary */
+	if (cache != NULL && (key = hash_tokens(&check)) != 0 &&
+	    cache_lookup(cache, key, check, &result, &error)) {
+		free_tokens();
+		has_result = 1;
+	} else {
+		error = evaluate_tokens(&result, &den, &has_result);
+		if (key != 0 && (error != CALC_OK || has_result))
+			cache_store(cache, key, check, result, error);
+	}
+
+	if (error != CALC_OK)
+		errx(1, "%s", calc_strerror(error));
+	if (has_result) {
+		if (get_rational() != RATIONAL_NONE)
+			format_rational(buf, sizeof(buf), result, den);
+		else
+			format_value(buf, sizeof(buf), result, get_scale());
+		printf("%s \n", buf);
+	}
 
 	return 0;
 }
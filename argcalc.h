@@ -0,0 +1,305 @@
+/*
+ * Copyright © 2022 — 2023 Artsiom Karakin <karakin2000@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef ARGCALC_H
+#define ARGCALC_H
+
+#include <stddef.h>
+
+#if defined(__OpenBSD__)
+#include <sys/queue.h>
+#include <err.h>
+#elif defined(NO_LIBBSD)
+/* Self-contained build, strtonum is compiled in from strtonum.c */
+#include "queue.h"
+#include <err.h>
+long long strtonum(const char *, long long, long long, const char **);
+#else
+#include "queue.h"
+#include <bsd/bsd.h>
+#endif
+
+/*
+ * TQST and TCOL are '?' and ':' of conditional. TIF, TELSE and TEND
+ * appear only in RPN queue and mark branches of conditional: value
+ * before TIF selects code up to TELSE or code from TELSE to TEND
+ */
+enum token_type { TNUM, TOPR, TLBR, TRBR, TVAR, TQST, TCOL,
+    TIF, TELSE, TEND };
+/* Token of infix expression or of RPN queue */
+struct token {
+	int type;
+	long long int payload;
+};
+
+/* Most tokens one operator becomes in RPN queue */
+#define MAX_LOWERED	5
+
+/*
+ * Enum's from precedence will be appearing only on operator stack.
+ * Comparisons, logical operators and conditional bind looser than
+ * arithmetic, left bracket is below everything. Comparisons bind in
+ * two tiers, see pops_before
+ */
+enum precedence { SUB = 1, ADD = 2, DIV = 3, MUL = 4,
+    GE = 0, LE = -1, GT = -2, LT = -3, NE = -4, EQ = -5,
+    AND = -6, OR = -7, QST = -8, COL = -9, LBR = -10 };
+
+/*
+ * Errors reported by arithmetic kernels and evaluator instead of
+ * exiting, so caller decide what to do with them
+ */
+enum calc_error { CALC_OK, CALC_OVERFLOW, CALC_DIVZERO, CALC_STACK,
+    CALC_RANGE, CALC_BRACKET, CALC_UNKNOWN, CALC_CYCLE, CALC_DEPENDENCY,
+    CALC_REDEFINED, CALC_DECLARED, CALC_CONDITIONAL };
+
+/*
+ * Instructions of compiled expression. Every operand is an index
+ * into the frame, which is laid out as literals, variables and
+ * registers one after another. Register n holds n'th slot of
+ * evaluation stack, so there are no pushes and pops at run time.
+ * OP_F* are unchecked operations, which are used when range analysis
+ * proves they can't overflow. OP_MDIV divides by literal multiplying
+ * by magic number in b, shift and adjustment of it are in aux.
+ * OP_DMUL and OP_DDIV work on decimals with scale in aux. OP_MOD*
+ * work on residues modulo modulus of program in Montgomery form.
+ * OP_Q* work on rationals, which keep denominators in the second half
+ * of the frame. Comparisons give 0 or 1, aux tells if they compare
+ * residues or rationals. OP_JZ jumps to instruction dst if a is zero,
+ * OP_JMP always jumps there.
+ */
+enum opcode { OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_TRAP,
+    OP_FADD, OP_FSUB, OP_FMUL, OP_FDIV, OP_MDIV, OP_DMUL, OP_DDIV,
+    OP_MODADD, OP_MODSUB, OP_MODMUL, OP_MODDIV,
+    OP_LT, OP_GT, OP_LE, OP_GE, OP_EQ, OP_NE, OP_MOV, OP_JZ, OP_JMP,
+    OP_QADD, OP_QSUB, OP_QMUL, OP_QDIV, OP_QMOV };
+
+/* Values of aux of comparisons */
+#define CMP_RESIDUE	1
+#define CMP_RATIONAL	2
+
+/*
+ * What operations do with results which don't fit: fail with
+ * CALC_OVERFLOW, wrap around or stick to LONG_MIN or LONG_MAX
+ */
+enum policy { POLICY_CHECKED, POLICY_WRAP, POLICY_SATURATE, POLICY_COUNT };
+
+/*
+ * How rationals are printed, RATIONAL_NONE if numbers aren't rationals
+ */
+enum rational { RATIONAL_NONE, RATIONAL_FRACTION, RATIONAL_INTEGER,
+    RATIONAL_COUNT };
+
+/* Frames evaluated at once by run_block */
+#define BLOCK		64
+
+/* Decimals are long long scaled by 10^scale */
+#define MAX_SCALE	18
+
+/*
+ * Modulus n with constants of its reduction. Odd n uses Montgomery
+ * reduction: residue x is kept as x * 2^64 mod n, ninv is -1/n mod 2^64,
+ * r2 is 2^128 mod n. Even n uses Barrett reduction: x is kept as it is,
+ * r2 is 1, mu is 2^(2 * bits) / n for n of bits bits
+ */
+struct modulus {
+	unsigned long long n;
+	unsigned long long ninv;
+	unsigned long long r2;
+	unsigned __int128 mu;
+	int bits;
+};
+
+struct insn {
+	unsigned char op;
+	unsigned char aux; /* Error code, DIV_* or scale, depending on op */
+	int dst;
+	int a;
+	int b;
+};
+
+struct program {
+	struct insn *code;
+	long long int *lits;
+	int *vars; /* Symbol index of every variable in the frame */
+	int ncode;
+	int nlits;
+	int nvars;
+	int nregs; /* Maximum depth of evaluation stack */
+	int nframe;
+	int result; /* Frame index of result or -1 if there is none */
+	int policy;
+	int scale; /* Digits after decimal point, 0 for integers */
+	struct modulus mod; /* Modulus of residues, n is 0 for integers */
+	int rational; /* Form of rationals, values are pairs in frame */
+};
+
+/*
+ * Division by invariant divisor d as multiplication by magic number:
+ * high half of product, corrected by dividend for DIV_ADD and DIV_SUB,
+ * shifted right by aux & DIV_SHIFT and rounded towards zero.
+ */
+#define DIV_SHIFT	0x3f
+#define DIV_ADD		0x40
+#define DIV_SUB		0x80
+
+struct divisor {
+	long long int magic;
+	unsigned char aux;
+};
+
+/* Range of values, both ends included */
+struct range {
+	long long int lo;
+	long long int hi;
+};
+
+/*
+ * Code generator state. Stack holds operands of values which are
+ * not consumed yet, tagged with the kind of frame area they live in.
+ */
+struct compiler {
+	struct program *prog;
+	int *stack;
+	int depth;
+	int stack_size;
+	int code_size;
+	int lits_size;
+	int vars_size;
+	int dead; /* Rest of expression is unreachable after OP_TRAP */
+	int *branches; /* Jump to patch and depth of open conditionals */
+	int nbranches;
+	int branches_size;
+};
+
+/* Counters of batch deduplication */
+struct memo_stats {
+	unsigned long lines;
+	unsigned long line_hits;
+	unsigned long nodes; /* Subexpressions looked up */
+	unsigned long node_hits;
+};
+
+/*
+ * Evaluator with memo of subexpressions. Arrays describe program
+ * being evaluated and are reused for the next one.
+ */
+struct memo {
+	struct cache *cache;
+	struct memo_stats stats;
+	int *producer; /* Instruction which wrote frame slot or -1 */
+	unsigned long long *hash; /* Hashes of subtree of instruction */
+	unsigned long long *check;
+	int *left; /* Instructions computing operands or -1 */
+	int *right;
+	int *size; /* Number of instructions in subtree */
+	int *state;
+	int *stack;
+	int frame_size;
+	int code_size;
+};
+
+const char *calc_strerror(int);
+
+int intern_symbol(const char *, size_t);
+const char *symbol_name(int);
+int symbol_count(void);
+const char *scan_word(const char *, struct token *, int *);
+const char *tokenize_word(const char *);
+int lower_operator(int, struct token *);
+int branch_operator(int, struct token *);
+int pops_before(int, int);
+void free_tokens(void);
+int shunting_yard(void);
+int tokenize_expression(const char *, size_t);
+int parse_expression(const char *, size_t);
+void compile_token(struct compiler *, int, long long int);
+void compile_rpn(struct program *);
+unsigned long long hash_tokens(unsigned long long *);
+
+int substract(long long int, long long int, long long int *);
+int addup(long long int, long long int, long long int *);
+int multiply(long long int, long long int, long long int *);
+int devide(long long int, long long int, long long int *);
+int divisor_init(struct divisor *, long long int);
+long long int divide_magic(long long int, long long int, unsigned char);
+
+void cc_init(struct compiler *, struct program *);
+void cc_num(struct compiler *, long long int);
+void cc_var(struct compiler *, int);
+void cc_op(struct compiler *, int);
+void cc_drop(struct compiler *);
+void cc_if(struct compiler *);
+void cc_else(struct compiler *);
+void cc_endif(struct compiler *);
+void cc_finish(struct compiler *);
+
+long long int *frame_alloc(const struct program *);
+void frame_init(const struct program *, long long int *);
+void frame_bind(const struct program *, long long int *,
+    const long long int *);
+int policy_from_name(const char *);
+void set_policy(int);
+int get_policy(void);
+void set_scale(int);
+int get_scale(void);
+const char *parse_decimal(const char *, int, long long int *);
+int format_value(char *, size_t, long long int, int);
+void set_modulus(unsigned long long);
+void init_modulus(struct modulus *, unsigned long long);
+long long int to_residue(const struct modulus *, long long int);
+int rational_from_name(const char *);
+void set_rational(int);
+int get_rational(void);
+int format_rational(char *, size_t, long long int, long long int);
+int rational_op(const struct program *, const struct insn *,
+    long long int *);
+unsigned long long get_modulus(void);
+int run_insn(const struct program *, const struct insn *, long long int *);
+int run_program(const struct program *, long long int *, long long int *);
+long long int *block_alloc(const struct program *);
+void run_block(const struct program *, long long int *, int,
+    unsigned char *);
+void free_program(struct program *);
+
+void declare_range(int, long long int, long long int);
+int symbol_range(int, struct range *);
+int range_op(int, const struct range *, const struct range *,
+    struct range *);
+void analyze_program(struct program *, struct range *);
+int checked_op(int);
+
+void memo_init(struct memo *, struct cache *);
+void memo_free(struct memo *);
+int memo_run(struct memo *, const struct program *, long long int *,
+    long long int *);
+
+int run_cells(const char *, int);
+int run_batch(int, int, int);
+int parse_parallel(const char *, size_t, int, struct program *);
+void load_expression(const char *, int, struct program *);
+int run_expression(const char *, int);
+int compile_image(const char *, int, const char *);
+int run_image(const char *, int, char **);
+int run_sweep(int, long long int, long long int, int, const char *);
+
+struct cache *cache_open(const char *);
+void cache_close(struct cache *);
+int cache_lookup(struct cache *, unsigned long long, unsigned long long,
+    long long int *, int *);
+void cache_store(struct cache *, unsigned long long, unsigned long long,
+    long long int, int);
+
+#endif /* ARGCALC_H */
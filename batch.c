@@ -0,0 +1,767 @@
+/*
+ * Copyright © 2022 — 2023 Artsiom Karakin <karakin2000@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Batch mode: expressions are read from standard input one per line
+ * and results are written one per line, empty line for failed ones.
+ *
+ * With jobs > 0 work is split into stages running on their own
+ * threads: reader, tokenizer, jobs evaluators and writer, which is
+ * the main thread. Stages pass batches of lines through lock free
+ * rings, writer puts them back in input order. Fixed pool of batches
+ * limits how far reader may run ahead of writer.
+ *
+ * With memo lines are looked up by their normalized tokens in table of
+ * lines evaluated before, and subexpressions shared by different lines
+ * are evaluated once by memo_run. Both tables are fixed size caches.
+ * In parallel, lines repeated in one batch are evaluated once, the
+ * first of them, see seen_line. Lines of other batches are looked up
+ * by evaluators when they get to them, so lines repeated in batches
+ * evaluated at the same time may be evaluated by both.
+ */
+#include "argcalc.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BATCH_BYTES	(64 * 1024)
+#define RING_SIZE	64 /* Power of two not less than number of batches */
+
+struct batch {
+	unsigned long seq;
+	unsigned long lineno; /* Number of the first line */
+	char *text;
+	size_t len;
+	size_t text_size;
+	int nlines;
+	int lines_size;
+	struct program *progs;
+	int *errors;
+	long long int *results;
+	int *has_result;
+	int *known; /* Result is taken from table of lines */
+	unsigned long long *keys; /* Key in table of lines or 0 */
+	unsigned long long *checks;
+	int *same; /* Earlier line of batch with the same tokens or -1 */
+	char *out;
+	size_t out_len;
+	size_t out_size;
+};
+
+/* Single producer single consumer ring */
+struct spsc {
+	_Alignas(64) _Atomic size_t head;
+	_Alignas(64) _Atomic size_t tail;
+	_Alignas(64) void *slots[RING_SIZE];
+};
+
+/* Bounded multi producer multi consumer ring of Dmitry Vyukov */
+struct mpmc {
+	_Alignas(64) _Atomic size_t head;
+	_Alignas(64) _Atomic size_t tail;
+	_Alignas(64) struct {
+		_Atomic size_t seq;
+		void *data;
+	} slots[RING_SIZE];
+};
+
+struct pipeline {
+	struct spsc free; /* Writer to reader */
+	struct spsc filled; /* Reader to tokenizer */
+	struct mpmc parsed; /* Tokenizer to evaluators */
+	struct mpmc done; /* Evaluators to writer */
+	_Atomic long total; /* Number of batches, -1 until input ends */
+	int jobs;
+	struct cache *lines; /* Tables for memo or NULL */
+	struct cache *nodes;
+	struct memo_stats stats; /* Lines are counted by tokenizer */
+	_Atomic unsigned long line_hits; /* Sums of evaluators */
+	_Atomic unsigned long nodes_seen;
+	_Atomic unsigned long node_hits;
+};
+
+/*
+ * Open addressed hash table of lines of batch by their keys, which
+ * keeps line index plus one, 0 is empty slot. It is at least twice as
+ * big as batch
+ */
+struct seen {
+	int *slots;
+	size_t size;
+};
+
+static struct batch end_of_input;
+static struct batch stop_evaluator;
+
+/*
+ * Wait a bit before retrying operation on a ring, sleeping if other
+ * stage is idle for long time
+ */
+static void
+backoff(int *spins)
+{
+	struct timespec ts = { 0, 100000 };
+
+	if (++*spins < 64)
+		return;
+	if (*spins < 1024)
+		sched_yield();
+	else
+		nanosleep(&ts, NULL);
+}
+
+static void
+spsc_push(struct spsc *r, void *p)
+{
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	int spins = 0;
+
+	while (tail - atomic_load_explicit(&r->head,
+	    memory_order_acquire) == RING_SIZE)
+		backoff(&spins);
+	r->slots[tail & (RING_SIZE - 1)] = p;
+	atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+}
+
+static void *
+spsc_pop(struct spsc *r)
+{
+	size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	void *p;
+	int spins = 0;
+
+	while (atomic_load_explicit(&r->tail, memory_order_acquire) == head)
+		backoff(&spins);
+	p = r->slots[head & (RING_SIZE - 1)];
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+	return p;
+}
+
+static void
+mpmc_init(struct mpmc *r)
+{
+	for (size_t i = 0; i < RING_SIZE; i++)
+		atomic_init(&r->slots[i].seq, i);
+	atomic_init(&r->head, 0);
+	atomic_init(&r->tail, 0);
+}
+
+static int
+mpmc_try_push(struct mpmc *r, void *p)
+{
+	size_t pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	size_t seq;
+	long dif;
+
+	for (;;) {
+		seq = atomic_load_explicit(&r->slots[pos & (RING_SIZE - 1)].seq,
+		    memory_order_acquire);
+		dif = (long)seq - (long)pos;
+		if (dif == 0) {
+			if (atomic_compare_exchange_weak_explicit(&r->tail,
+			    &pos, pos + 1, memory_order_relaxed,
+			    memory_order_relaxed))
+				break;
+		} else if (dif < 0)
+			return 0;
+		else
+			pos = atomic_load_explicit(&r->tail,
+			    memory_order_relaxed);
+	}
+	r->slots[pos & (RING_SIZE - 1)].data = p;
+	atomic_store_explicit(&r->slots[pos & (RING_SIZE - 1)].seq, pos + 1,
+	    memory_order_release);
+	return 1;
+}
+
+static void *
+mpmc_try_pop(struct mpmc *r)
+{
+	size_t pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+	size_t seq;
+	long dif;
+	void *p;
+
+	for (;;) {
+		seq = atomic_load_explicit(&r->slots[pos & (RING_SIZE - 1)].seq,
+		    memory_order_acquire);
+		dif = (long)seq - (long)(pos + 1);
+		if (dif == 0) {
+			if (atomic_compare_exchange_weak_explicit(&r->head,
+			    &pos, pos + 1, memory_order_relaxed,
+			    memory_order_relaxed))
+				break;
+		} else if (dif < 0)
+			return NULL;
+		else
+			pos = atomic_load_explicit(&r->head,
+			    memory_order_relaxed);
+	}
+	p = r->slots[pos & (RING_SIZE - 1)].data;
+	atomic_store_explicit(&r->slots[pos & (RING_SIZE - 1)].seq,
+	    pos + RING_SIZE, memory_order_release);
+	return p;
+}
+
+static void
+mpmc_push(struct mpmc *r, void *p)
+{
+	int spins = 0;
+
+	while (!mpmc_try_push(r, p))
+		backoff(&spins);
+}
+
+static void *
+mpmc_pop(struct mpmc *r)
+{
+	void *p;
+	int spins = 0;
+
+	while ((p = mpmc_try_pop(r)) == NULL)
+		backoff(&spins);
+	return p;
+}
+
+/*
+ * Make room for n lines in batch
+ */
+static void
+grow_lines(struct batch *b, int n)
+{
+	if (n <= b->lines_size)
+		return;
+	b->lines_size = n * 2;
+	if ((b->progs = reallocarray(b->progs, b->lines_size,
+	    sizeof(*b->progs))) == NULL ||
+	    (b->errors = reallocarray(b->errors, b->lines_size,
+	    sizeof(*b->errors))) == NULL ||
+	    (b->results = reallocarray(b->results, b->lines_size,
+	    sizeof(*b->results))) == NULL ||
+	    (b->has_result = reallocarray(b->has_result, b->lines_size,
+	    sizeof(*b->has_result))) == NULL ||
+	    (b->known = reallocarray(b->known, b->lines_size,
+	    sizeof(*b->known))) == NULL ||
+	    (b->keys = reallocarray(b->keys, b->lines_size,
+	    sizeof(*b->keys))) == NULL ||
+	    (b->checks = reallocarray(b->checks, b->lines_size,
+	    sizeof(*b->checks))) == NULL ||
+	    (b->same = reallocarray(b->same, b->lines_size,
+	    sizeof(*b->same))) == NULL)
+		errx(1, "Couldn't grow batch");
+}
+
+/*
+ * Parse and compile line of len characters. Returns error code. If
+ * table of lines isn't NULL, line is looked up in it by key and check
+ * of its tokens and *known is set when its result is found there
+ */
+static int
+compile_line(const char *line, size_t len, struct program *prog,
+    struct cache *lines, unsigned long long *key,
+    unsigned long long *check, int *known, long long int *result)
+{
+	int error;
+
+	memset(prog, 0, sizeof(*prog));
+	prog->result = -1;
+	*key = 0;
+	*known = 0;
+	if ((error = tokenize_expression(line, len)) != CALC_OK)
+		return error;
+	if (lines != NULL && (*key = hash_tokens(check)) != 0 &&
+	    cache_lookup(lines, *key, *check, result, &error)) {
+		free_tokens();
+		*known = 1;
+		return error;
+	}
+	if ((error = shunting_yard()) != CALC_OK)
+		return error;
+	compile_rpn(prog);
+	if (prog->nvars > 0)
+		return CALC_UNKNOWN;
+	return CALC_OK;
+}
+
+/*
+ * Run compiled line in frame, which is grown if needed. Line goes
+ * to table of lines if it has key
+ */
+static int
+run_line(const struct program *prog, struct memo *memo,
+    struct cache *lines, unsigned long long key, unsigned long long check,
+    long long int **frame, int *frame_size, long long int *result,
+    int *has_result)
+{
+	long long int *f;
+	int error;
+
+	*has_result = 0;
+	if (prog->nframe > *frame_size) {
+		if ((f = reallocarray(*frame, prog->nframe,
+		    sizeof(*f))) == NULL)
+			errx(1, "Couldn't grow frame");
+		*frame = f;
+		*frame_size = prog->nframe;
+	}
+	frame_init(prog, *frame);
+	if (memo != NULL)
+		error = memo_run(memo, prog, *frame, result);
+	else
+		error = run_program(prog, *frame, result);
+	if (error == CALC_OK)
+		*has_result = prog->result >= 0;
+	if (key != 0 && (error != CALC_OK || *has_result))
+		cache_store(lines, key, check, *result, error);
+	return error;
+}
+
+/*
+ * Evaluate lines of standard input one after another
+ */
+static int
+run_sequential(struct pipeline *pl)
+{
+	struct program prog;
+	struct memo memo;
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t len;
+	long long int *frame = NULL, result;
+	unsigned long long key, check;
+	unsigned long lineno = 0;
+	int frame_size = 0, error, has_result, known, failed = 0;
+	char buf[32];
+
+	memo_init(&memo, pl->nodes);
+	while ((len = getline(&line, &line_size, stdin)) != -1) {
+		lineno++;
+		has_result = 0;
+		error = compile_line(line, len, &prog, pl->lines, &key,
+		    &check, &known, &result);
+		if (known) {
+			pl->stats.line_hits++;
+			has_result = error == CALC_OK;
+		} else if (error == CALC_OK)
+			error = run_line(&prog, pl->nodes ? &memo : NULL,
+			    pl->lines, key, check, &frame, &frame_size,
+			    &result, &has_result);
+		free_program(&prog);
+		if (error != CALC_OK) {
+			warnx("line %lu: %s", lineno, calc_strerror(error));
+			failed = 1;
+		}
+		if (has_result) {
+			format_value(buf, sizeof(buf), result, get_scale());
+			puts(buf);
+		} else
+			putchar('\n');
+	}
+	if (ferror(stdin))
+		err(1, "stdin");
+	pl->stats.lines = lineno;
+	pl->stats.nodes = memo.stats.nodes;
+	pl->stats.node_hits = memo.stats.node_hits;
+	memo_free(&memo);
+	free(line);
+	free(frame);
+
+	return failed;
+}
+
+/*
+ * Read standard input into batches cut at line ends
+ */
+static void *
+reader(void *arg)
+{
+	struct pipeline *pl = arg;
+	struct batch *b;
+	char *carry = NULL, *nl, *t;
+	size_t carry_len = 0, carry_size = 0, avail;
+	unsigned long seq = 0;
+	ssize_t n;
+	int eof = 0;
+
+	while (!eof) {
+		b = spsc_pop(&pl->free);
+		b->len = 0;
+		if (carry_len > 0) {
+			if (b->text_size < carry_len + BATCH_BYTES) {
+				b->text_size = carry_len + BATCH_BYTES;
+				if ((t = realloc(b->text,
+				    b->text_size)) == NULL)
+					errx(1, "Couldn't grow batch");
+				b->text = t;
+			}
+			memcpy(b->text, carry, carry_len);
+			b->len = carry_len;
+			carry_len = 0;
+		}
+		/* Read until batch has at least one whole line */
+		for (;;) {
+			if (b->text_size - b->len < BATCH_BYTES / 2) {
+				b->text_size = b->text_size * 2 + BATCH_BYTES;
+				if ((t = realloc(b->text,
+				    b->text_size)) == NULL)
+					errx(1, "Couldn't grow batch");
+				b->text = t;
+			}
+			avail = b->text_size - b->len;
+			if ((n = read(STDIN_FILENO, b->text + b->len,
+			    avail)) == -1)
+				err(1, "stdin");
+			if (n == 0) {
+				eof = 1;
+				break;
+			}
+			b->len += n;
+			if (memchr(b->text + b->len - n, '\n', n) != NULL)
+				break;
+		}
+		/* Partial line at the end goes to the next batch */
+		if (!eof) {
+			for (nl = b->text + b->len - 1; *nl != '\n'; nl--)
+				;
+			carry_len = b->text + b->len - (nl + 1);
+			if (carry_len > carry_size) {
+				carry_size = carry_len;
+				if ((carry = realloc(carry,
+				    carry_size)) == NULL)
+					errx(1, "Couldn't grow batch");
+			}
+			memcpy(carry, nl + 1, carry_len);
+			b->len -= carry_len;
+		}
+		if (b->len == 0) {
+			spsc_push(&pl->free, b);
+			continue;
+		}
+		b->seq = seq++;
+		spsc_push(&pl->filled, b);
+	}
+	free(carry);
+	spsc_push(&pl->filled, &end_of_input);
+
+	return NULL;
+}
+
+/*
+ * Empty table of lines for batch of n lines
+ */
+static void
+seen_reset(struct seen *s, int n)
+{
+	size_t size = 64;
+
+	while (size < (size_t)n * 2)
+		size *= 2;
+	if (size > s->size) {
+		free(s->slots);
+		if ((s->slots = calloc(size, sizeof(*s->slots))) == NULL)
+			errx(1, "Couldn't allocate table of lines");
+		s->size = size;
+	}
+	memset(s->slots, 0, s->size * sizeof(*s->slots));
+}
+
+/*
+ * Return earlier line of batch with the same tokens as line i or -1,
+ * adding line i to table if there is none
+ */
+static int
+seen_line(struct seen *s, const struct batch *b, int i)
+{
+	size_t h = b->keys[i] & (s->size - 1);
+	int j;
+
+	for (; (j = s->slots[h]) != 0; h = (h + 1) & (s->size - 1))
+		if (b->keys[j - 1] == b->keys[i] &&
+		    b->checks[j - 1] == b->checks[i])
+			return j - 1;
+	s->slots[h] = i + 1;
+	return -1;
+}
+
+/*
+ * Split batches into lines and compile them. Front end is not
+ * reentrant, so there is only one tokenizer
+ */
+static void *
+tokenizer(void *arg)
+{
+	struct pipeline *pl = arg;
+	struct batch *b;
+	struct seen seen = { NULL, 0 };
+	char *line, *end, *nl;
+	unsigned long lineno = 1;
+	long total = 0;
+	int i;
+
+	while ((b = spsc_pop(&pl->filled)) != &end_of_input) {
+		b->nlines = 0;
+		b->lineno = lineno;
+		end = b->text + b->len;
+		for (line = b->text; line < end; line = nl + 1) {
+			if ((nl = memchr(line, '\n', end - line)) == NULL)
+				nl = end;
+			grow_lines(b, b->nlines + 1);
+			i = b->nlines++;
+			b->errors[i] = compile_line(line, nl - line,
+			    &b->progs[i], pl->lines, &b->keys[i],
+			    &b->checks[i], &b->known[i], &b->results[i]);
+			pl->stats.line_hits += b->known[i];
+		}
+		/* Lines which evaluator runs and may store in table */
+		seen_reset(&seen, b->nlines);
+		for (i = 0; i < b->nlines; i++)
+			b->same[i] = !b->known[i] && b->keys[i] != 0 &&
+			    b->errors[i] == CALC_OK ?
+			    seen_line(&seen, b, i) : -1;
+		lineno += b->nlines;
+		mpmc_push(&pl->parsed, b);
+		total++;
+	}
+	pl->stats.lines = lineno - 1;
+	atomic_store_explicit(&pl->total, total, memory_order_release);
+	for (i = 0; i < pl->jobs; i++)
+		mpmc_push(&pl->parsed, &stop_evaluator);
+	free(seen.slots);
+
+	return NULL;
+}
+
+/*
+ * Append text of results to output buffer of batch
+ */
+static void
+format_results(struct batch *b)
+{
+	char *o;
+	int n;
+
+	b->out_len = 0;
+	for (int i = 0; i < b->nlines; i++) {
+		if (b->out_size - b->out_len < 32) {
+			b->out_size = b->out_size * 2 + 4096;
+			if ((o = realloc(b->out, b->out_size)) == NULL)
+				errx(1, "Couldn't grow output");
+			b->out = o;
+		}
+		n = 0;
+		if (b->has_result[i])
+			n = format_value(b->out + b->out_len, 32,
+			    b->results[i], get_scale());
+		b->out[b->out_len + n] = '\n';
+		b->out_len += n + 1;
+	}
+}
+
+static void *
+evaluator(void *arg)
+{
+	struct pipeline *pl = arg;
+	struct batch *b;
+	struct memo memo;
+	long long int *frame = NULL;
+	unsigned long hits = 0;
+	int frame_size = 0, j;
+
+	memo_init(&memo, pl->nodes);
+	while ((b = mpmc_pop(&pl->parsed)) != &stop_evaluator) {
+		for (int i = 0; i < b->nlines; i++) {
+			b->has_result[i] = 0;
+			/* Repeated line is known if the first one is stored */
+			if ((j = b->same[i]) >= 0 &&
+			    (b->errors[j] != CALC_OK || b->has_result[j])) {
+				b->known[i] = 1;
+				b->errors[i] = b->errors[j];
+				b->results[i] = b->results[j];
+				hits++;
+			} else if (!b->known[i] && b->keys[i] != 0 &&
+			    cache_lookup(pl->lines, b->keys[i], b->checks[i],
+			    &b->results[i], &b->errors[i])) {
+				b->known[i] = 1;
+				hits++;
+			}
+			if (b->known[i])
+				b->has_result[i] = b->errors[i] == CALC_OK;
+			else if (b->errors[i] == CALC_OK)
+				b->errors[i] = run_line(&b->progs[i],
+				    pl->nodes ? &memo : NULL, pl->lines,
+				    b->keys[i], b->checks[i], &frame,
+				    &frame_size, &b->results[i],
+				    &b->has_result[i]);
+			free_program(&b->progs[i]);
+		}
+		format_results(b);
+		mpmc_push(&pl->done, b);
+	}
+	atomic_fetch_add(&pl->line_hits, hits);
+	atomic_fetch_add(&pl->nodes_seen, memo.stats.nodes);
+	atomic_fetch_add(&pl->node_hits, memo.stats.node_hits);
+	memo_free(&memo);
+	free(frame);
+
+	return NULL;
+}
+
+/*
+ * Write batches in order of input, returning them to reader
+ */
+static int
+writer(struct pipeline *pl, int nbatches)
+{
+	struct batch **pending, *b;
+	unsigned long next = 0;
+	long total;
+	int spins = 0, failed = 0;
+
+	if ((pending = calloc(nbatches, sizeof(*pending))) == NULL)
+		errx(1, "Couldn't allocate reorder buffer");
+
+	for (;;) {
+		if ((b = mpmc_try_pop(&pl->done)) == NULL) {
+			total = atomic_load_explicit(&pl->total,
+			    memory_order_acquire);
+			if (total >= 0 && next == (unsigned long)total)
+				break;
+			backoff(&spins);
+			continue;
+		}
+		spins = 0;
+		pending[b->seq % nbatches] = b;
+		while ((b = pending[next % nbatches]) != NULL &&
+		    b->seq == next) {
+			for (int i = 0; i < b->nlines; i++) {
+				if (b->errors[i] == CALC_OK)
+					continue;
+				warnx("line %lu: %s", b->lineno + i,
+				    calc_strerror(b->errors[i]));
+				failed = 1;
+			}
+			if (fwrite(b->out, 1, b->out_len, stdout) !=
+			    b->out_len)
+				err(1, "stdout");
+			pending[next % nbatches] = NULL;
+			spsc_push(&pl->free, b);
+			next++;
+		}
+	}
+	free(pending);
+
+	return failed;
+}
+
+/*
+ * Print how many lines and subexpressions were found in memo
+ */
+static void
+print_stats(const struct memo_stats *st)
+{
+	fprintf(stderr, "lines %lu, repeated %lu (%.1f%%)\n"
+	    "subexpressions %lu, repeated %lu (%.1f%%)\n",
+	    st->lines, st->line_hits,
+	    st->lines ? 100.0 * st->line_hits / st->lines : 0.0,
+	    st->nodes, st->node_hits,
+	    st->nodes ? 100.0 * st->node_hits / st->nodes : 0.0);
+}
+
+/*
+ * Evaluate every line of standard input. With jobs > 0 stages of
+ * evaluation run in parallel with jobs evaluator threads. With memo
+ * repeated lines and subexpressions are evaluated once, stats prints
+ * how often that happened
+ */
+int
+run_batch(int jobs, int memo, int stats)
+{
+	struct pipeline *pl;
+	struct batch *batches = NULL;
+	pthread_t *threads = NULL;
+	int nbatches = 0, failed;
+
+	if ((pl = aligned_alloc(64, sizeof(*pl))) == NULL)
+		errx(1, "Couldn't allocate pipeline");
+	memset(pl, 0, sizeof(*pl));
+	if (memo) {
+		pl->lines = cache_open(NULL);
+		pl->nodes = cache_open(NULL);
+	}
+
+	if (jobs <= 0)
+		failed = run_sequential(pl);
+	else {
+		/* Enough batches to keep every stage busy */
+		nbatches = 2 * jobs + 4;
+		if (nbatches > RING_SIZE)
+			nbatches = RING_SIZE;
+		if ((batches = calloc(nbatches, sizeof(*batches))) == NULL ||
+		    (threads = calloc(jobs + 2, sizeof(*threads))) == NULL)
+			errx(1, "Couldn't allocate pipeline");
+		mpmc_init(&pl->parsed);
+		mpmc_init(&pl->done);
+		atomic_init(&pl->total, -1);
+		pl->jobs = jobs;
+		for (int i = 0; i < nbatches; i++)
+			spsc_push(&pl->free, &batches[i]);
+
+		if (pthread_create(&threads[0], NULL, reader, pl) != 0 ||
+		    pthread_create(&threads[1], NULL, tokenizer, pl) != 0)
+			errx(1, "Couldn't start pipeline");
+		for (int i = 0; i < jobs; i++)
+			if (pthread_create(&threads[i + 2], NULL, evaluator,
+			    pl) != 0)
+				errx(1, "Couldn't start evaluator");
+
+		failed = writer(pl, nbatches);
+		for (int i = 0; i < jobs + 2; i++)
+			pthread_join(threads[i], NULL);
+		pl->stats.line_hits += atomic_load(&pl->line_hits);
+		pl->stats.nodes = atomic_load(&pl->nodes_seen);
+		pl->stats.node_hits = atomic_load(&pl->node_hits);
+	}
+
+	if (stats)
+		print_stats(&pl->stats);
+	for (int i = 0; i < nbatches; i++) {
+		free(batches[i].text);
+		free(batches[i].progs);
+		free(batches[i].errors);
+		free(batches[i].results);
+		free(batches[i].has_result);
+		free(batches[i].known);
+		free(batches[i].keys);
+		free(batches[i].checks);
+		free(batches[i].same);
+		free(batches[i].out);
+	}
+	if (pl->lines != NULL)
+		cache_close(pl->lines);
+	if (pl->nodes != NULL)
+		cache_close(pl->nodes);
+	free(batches);
+	free(threads);
+	free(pl);
+
+	return failed;
+}
@@ -0,0 +1,114 @@
+/*
+ * Copyright © 2022 — 2023 Artsiom Karakin <karakin2000@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Measure time from exec to exit of argcalc binaries given as
+ * arguments, the way shell scripts calling it in loops see it
+ *	startup [-n runs] binary ...
+ */
+#include <sys/wait.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+extern char **environ;
+
+static int
+cmp_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * Run binary once with small expression, return wall time in ns
+ */
+static long long
+run_once(const char *binary, posix_spawn_file_actions_t *fa)
+{
+	char *args[] = { (char *)binary, "1", "+", "2", "*", "3", NULL };
+	struct timespec start, end;
+	pid_t pid;
+	int status;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (posix_spawn(&pid, binary, fa, NULL, args, environ) != 0)
+		err(1, "posix_spawn %s", binary);
+	if (waitpid(pid, &status, 0) == -1)
+		err(1, "waitpid");
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		errx(1, "%s failed", binary);
+
+	return (end.tv_sec - start.tv_sec) * 1000000000LL +
+	    (end.tv_nsec - start.tv_nsec);
+}
+
+int
+main(int argc, char **argv)
+{
+	posix_spawn_file_actions_t fa;
+	long long *times, total;
+	int ch, runs = 1000;
+
+	while ((ch = getopt(argc, argv, "n:")) != -1) {
+		switch (ch) {
+		case 'n':
+			runs = strtol(optarg, NULL, 10);
+			if (runs <= 0)
+				errx(1, "runs must be positive");
+			break;
+		default:
+			fprintf(stderr, "usage: startup [-n runs] binary ...\n");
+			return 1;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if ((times = calloc(runs, sizeof(*times))) == NULL)
+		err(1, NULL);
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_addopen(&fa, STDOUT_FILENO, "/dev/null",
+	    O_WRONLY, 0);
+
+	printf("%-24s %10s %10s %10s %10s\n", "binary", "min_us", "p50_us",
+	    "p99_us", "mean_us");
+	for (int i = 0; i < argc; i++) {
+		/* Warm up page cache and dynamic loader caches */
+		for (int j = 0; j < 10; j++)
+			run_once(argv[i], &fa);
+		total = 0;
+		for (int j = 0; j < runs; j++) {
+			times[j] = run_once(argv[i], &fa);
+			total += times[j];
+		}
+		qsort(times, runs, sizeof(*times), cmp_ll);
+		printf("%-24s %10.1f %10.1f %10.1f %10.1f\n", argv[i],
+		    times[0] / 1e3, times[runs / 2] / 1e3,
+		    times[(runs * 99) / 100] / 1e3, total / 1e3 / runs);
+	}
+
+	posix_spawn_file_actions_destroy(&fa);
+	free(times);
+	return 0;
+}
@@ -0,0 +1,362 @@
+/*
+ * Copyright © 2022 — 2023 Artsiom Karakin <karakin2000@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Compare argcalc with expr, bc and awk on shell workloads built from
+ * the same generated expressions:
+ *	call	one process per expression, as in $(expr ...)
+ *	batch	file of expressions, one per line, read by one process
+ *		or by shell loop calling a process per line
+ *	huge	one expression of many terms
+ * Expressions only add and multiply small positive numbers, so every
+ * tool gives the same results, which are checked before timing. Every
+ * tool and workload gives a line of JSON with throughput in expressions,
+ * or terms of huge one, per second, p50 and p99 wall time of runs and
+ * peak RSS of processes. Tools which aren't installed are skipped
+ *	workload [-n calls] [-l lines] [-t terms] [-r runs] argcalc
+ */
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+extern char **environ;
+
+static char dir[] = "/tmp/argcalc-bench.XXXXXX";
+static char out_path[PATH_MAX];
+
+static int
+cmp_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void
+path(char *buf, const char *name)
+{
+	snprintf(buf, PATH_MAX, "%s/%s", dir, name);
+}
+
+/*
+ * Run argv with standard input from file in, if it isn't NULL, and
+ * output to out_path. Returns wall time in ns, peak RSS in KB goes to
+ * *rss, -1 if tool isn't found
+ */
+static long long
+run_once(char **argv, const char *in, long *rss)
+{
+	posix_spawn_file_actions_t fa;
+	struct timespec start, end;
+	struct rusage ru;
+	pid_t pid;
+	int status, error;
+
+	posix_spawn_file_actions_init(&fa);
+	if (in != NULL)
+		posix_spawn_file_actions_addopen(&fa, STDIN_FILENO, in,
+		    O_RDONLY, 0);
+	posix_spawn_file_actions_addopen(&fa, STDOUT_FILENO, out_path,
+	    O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	error = posix_spawnp(&pid, argv[0], &fa, NULL, argv, environ);
+	posix_spawn_file_actions_destroy(&fa);
+	if (error == ENOENT)
+		return -1;
+	if (error != 0) {
+		errno = error;
+		err(1, "posix_spawn %s", argv[0]);
+	}
+	/* Usage of process includes children it waited for */
+	if (wait4(pid, &status, 0, &ru) == -1)
+		err(1, "wait4");
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) == 127)
+		return -1;
+	if (WEXITSTATUS(status) != 0)
+		errx(1, "%s failed", argv[0]);
+
+	*rss = ru.ru_maxrss;
+	return (end.tv_sec - start.tv_sec) * 1000000000LL +
+	    (end.tv_nsec - start.tv_nsec);
+}
+
+/*
+ * Sum of numbers printed by the last run
+ */
+static long long
+output_sum(void)
+{
+	FILE *f;
+	long long sum = 0, v;
+
+	if ((f = fopen(out_path, "r")) == NULL)
+		err(1, "%s", out_path);
+	while (fscanf(f, "%lld", &v) == 1)
+		sum += v;
+	fclose(f);
+	return sum;
+}
+
+/*
+ * Run tool runs times, every run evaluates items expressions or terms,
+ * whose results add up to expect, and print JSON line of measurements
+ */
+static void
+measure(const char *workload, const char *tool, char **argv,
+    const char *in, int runs, long long items, long long expect)
+{
+	long long *times, total = 0, t;
+	long rss, max_rss = 0;
+
+	printf("{\"workload\": \"%s\", \"tool\": \"%s\", ", workload, tool);
+	/* The first run warms up caches and checks results */
+	if (run_once(argv, in, &rss) == -1) {
+		printf("\"skipped\": \"not found\"}\n");
+		fflush(stdout);
+		return;
+	}
+	if (output_sum() != expect) {
+		printf("\"skipped\": \"wrong result\"}\n");
+		fflush(stdout);
+		return;
+	}
+
+	if ((times = calloc(runs, sizeof(*times))) == NULL)
+		err(1, NULL);
+	for (int i = 0; i < runs; i++) {
+		if ((t = run_once(argv, in, &rss)) == -1)
+			errx(1, "%s failed", tool);
+		times[i] = t;
+		total += t;
+		if (rss > max_rss)
+			max_rss = rss;
+	}
+	qsort(times, runs, sizeof(*times), cmp_ll);
+	printf("\"items\": %lld, \"runs\": %d, \"items_per_s\": %.1f, "
+	    "\"p50_ms\": %.3f, \"p99_ms\": %.3f, \"max_rss_kb\": %ld}\n",
+	    items, runs, items * runs / (total / 1e9), times[runs / 2] / 1e6,
+	    times[(runs * 99) / 100] / 1e6, max_rss);
+	fflush(stdout);
+	free(times);
+}
+
+static FILE *
+create(const char *name)
+{
+	char buf[PATH_MAX];
+	FILE *f;
+
+	path(buf, name);
+	if ((f = fopen(buf, "w")) == NULL)
+		err(1, "%s", buf);
+	return f;
+}
+
+static void
+finish(FILE *f)
+{
+	if (ferror(f) || fclose(f) == EOF)
+		err(1, "write");
+}
+
+/*
+ * One call per expression. Every process gets the same expression, so
+ * runs differ only by noise
+ */
+static void
+bench_call(char *argcalc, int calls)
+{
+	char in[PATH_MAX];
+	char *argcalc_argv[] = { argcalc, "7", "+", "6", "*", "5", NULL };
+	char *expr_argv[] = { "expr", "7", "+", "6", "*", "5", NULL };
+	char *bc_argv[] = { "bc", NULL };
+	char *awk_argv[] = { "awk", "BEGIN { print 7 + 6 * 5 }", NULL };
+	FILE *f;
+
+	f = create("call.txt");
+	fprintf(f, "7 + 6 * 5\n");
+	finish(f);
+	path(in, "call.txt");
+
+	measure("call", "argcalc", argcalc_argv, NULL, calls, 1, 37);
+	measure("call", "expr", expr_argv, NULL, calls, 1, 37);
+	measure("call", "bc", bc_argv, in, calls, 1, 37);
+	measure("call", "awk", awk_argv, NULL, calls, 1, 37);
+}
+
+/*
+ * Lines of "a + b * c". Shell loops split words of line, with globbing
+ * off so "*" stays as it is
+ */
+static void
+bench_batch(char *argcalc, int lines, int runs)
+{
+	char in[PATH_MAX];
+	char *batch_argv[] = { argcalc, "-b", NULL };
+	char *loop_argv[] = { "sh", "-c",
+	    "set -f; while read -r l; do \"$0\" $l; done", argcalc, NULL };
+	char *expr_argv[] = { "sh", "-c",
+	    "set -f; while read -r l; do expr $l; done", NULL };
+	char *bc_argv[] = { "bc", NULL };
+	char *awk_argv[] = { "awk", "{ print $1 + $3 * $5 }", NULL };
+	long long sum = 0;
+	int a, b, c;
+	FILE *f;
+
+	f = create("batch.txt");
+	for (int i = 0; i < lines; i++) {
+		a = 1 + rand() % 999;
+		b = 1 + rand() % 999;
+		c = 1 + rand() % 999;
+		fprintf(f, "%d + %d * %d\n", a, b, c);
+		sum += a + b * c;
+	}
+	finish(f);
+	path(in, "batch.txt");
+
+	measure("batch", "argcalc -b", batch_argv, in, runs, lines, sum);
+	measure("batch", "bc", bc_argv, in, runs, lines, sum);
+	measure("batch", "awk", awk_argv, in, runs, lines, sum);
+	/* Process per line is slow enough to be measured once */
+	measure("batch", "sh loop argcalc", loop_argv, in, 1, lines, sum);
+	measure("batch", "sh loop expr", expr_argv, in, 1, lines, sum);
+}
+
+/*
+ * "a * b + c * d + ..." of terms products. Too long for command line,
+ * so there is no expr, and awk gets it as program in file
+ */
+static void
+bench_huge(char *argcalc, int terms, int runs)
+{
+	char in[PATH_MAX], prog[PATH_MAX], image[PATH_MAX];
+	char *file_argv[] = { argcalc, "-e", in, NULL };
+	char *jobs_argv[] = { argcalc, "-j", "4", "-e", in, NULL };
+	char *image_argv[] = { argcalc, "-x", image, NULL };
+	char *compile_argv[] = { argcalc, "-e", in, "-o", image, NULL };
+	char *bc_argv[] = { "bc", NULL };
+	char *awk_argv[] = { "awk", "-f", prog, NULL };
+	long long sum = 0;
+	long rss;
+	int a, b;
+	FILE *f, *g;
+
+	f = create("huge.txt");
+	g = create("huge.awk");
+	/* Some awks print big numbers as 1e+10 and clamp %d to 32 bits */
+	fprintf(g, "BEGIN { printf \"%%.0f\\n\", ");
+	for (int i = 0; i < terms; i++) {
+		a = 1 + rand() % 999;
+		b = 1 + rand() % 999;
+		fprintf(f, "%s%d * %d", i > 0 ? " + " : "", a, b);
+		fprintf(g, "%s%d * %d", i > 0 ? " + " : "", a, b);
+		sum += a * b;
+	}
+	fprintf(f, "\n");
+	fprintf(g, " }\n");
+	finish(f);
+	finish(g);
+	path(in, "huge.txt");
+	path(prog, "huge.awk");
+	path(image, "huge.img");
+	if (run_once(compile_argv, NULL, &rss) == -1)
+		errx(1, "%s -o failed", argcalc);
+
+	measure("huge", "argcalc -e", file_argv, NULL, runs, terms, sum);
+	measure("huge", "argcalc -j 4 -e", jobs_argv, NULL, runs, terms, sum);
+	measure("huge", "argcalc -x", image_argv, NULL, runs, terms, sum);
+	measure("huge", "bc", bc_argv, in, runs, terms, sum);
+	measure("huge", "awk", awk_argv, NULL, runs, terms, sum);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: workload [-n calls] [-l lines] [-t terms] "
+	    "[-r runs] argcalc\n");
+	exit(1);
+}
+
+static int
+number(const char *s)
+{
+	long v = strtol(s, NULL, 10);
+
+	if (v <= 0 || v > INT_MAX)
+		errx(1, "\"%s\" must be positive", s);
+	return v;
+}
+
+int
+main(int argc, char **argv)
+{
+	char *argcalc, *rm_argv[] = { "rm", "-rf", dir, NULL };
+	int ch, calls = 1000, lines = 10000, terms = 100000, runs = 20;
+	long rss;
+
+	while ((ch = getopt(argc, argv, "l:n:r:t:")) != -1) {
+		switch (ch) {
+		case 'l':
+			lines = number(optarg);
+			break;
+		case 'n':
+			calls = number(optarg);
+			break;
+		case 'r':
+			runs = number(optarg);
+			break;
+		case 't':
+			terms = number(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1)
+		usage();
+	/* Shell loop runs it by path, which must not depend on cwd */
+	if ((argcalc = realpath(argv[0], NULL)) == NULL)
+		err(1, "%s", argv[0]);
+
+	if (mkdtemp(dir) == NULL)
+		err(1, "mkdtemp");
+	path(out_path, "out");
+	srand(1);
+
+	bench_call(argcalc, calls);
+	bench_batch(argcalc, lines, runs);
+	bench_huge(argcalc, terms, runs);
+
+	run_once(rm_argv, NULL, &rss);
+	free(argcalc);
+	return 0;
+}
@@ -0,0 +1,205 @@
+/*
+ * Copyright © 2022 — 2023 Artsiom Karakin <karakin2000@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Result cache shared by all argcalc processes using the same file.
+ * File is fixed size open addressing hash table mapped into memory.
+ * Entries are claimed by compare and swap of the key and published by
+ * storing state last, so readers and writers never take locks and
+ * never see half written entry as ready.
+ */
+#include "argcalc.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define CACHE_MAGIC	0x6172676361630001ULL /* "argcac" and version */
+#define CACHE_SLOTS	(1 << 16)
+#define CACHE_PROBES	16
+
+#if ATOMIC_LLONG_LOCK_FREE != 2 || ATOMIC_INT_LOCK_FREE != 2
+#error "Cache needs lock free atomics to be shared between processes"
+#endif
+
+struct cache_entry {
+	_Atomic unsigned long long key;
+	_Atomic unsigned long long check;
+	_Atomic long long value;
+	_Atomic unsigned int state; /* 0 until written, then error + 1 */
+	unsigned int pad;
+};
+
+struct cache_header {
+	_Atomic unsigned long long magic;
+	unsigned long long pad[7];
+};
+
+struct cache {
+	struct cache_header *header;
+	struct cache_entry *entries;
+	size_t size;
+};
+
+/*
+ * Map file at path of size bytes, creating it if needed
+ */
+static void *
+map_file(const char *path, size_t size)
+{
+	struct stat st;
+	void *p;
+	int fd;
+
+	if ((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666)) == -1) {
+		warn("%s", path);
+		return NULL;
+	}
+	if (fstat(fd, &st) == -1) {
+		warn("%s", path);
+		close(fd);
+		return NULL;
+	}
+	/* Concurrent creators extend file to the same size */
+	if (st.st_size == 0 && ftruncate(fd, size) == -1) {
+		warn("%s", path);
+		close(fd);
+		return NULL;
+	}
+	if (st.st_size != 0 && (size_t)st.st_size != size) {
+		warnx("%s: not a cache file", path);
+		close(fd);
+		return NULL;
+	}
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		warn("%s", path);
+		return NULL;
+	}
+	return p;
+}
+
+/*
+ * Map cache file at path creating it if needed. Returns NULL if file
+ * can't be used, calculation goes on without cache then. Without path
+ * cache lives in anonymous memory shared only by threads of process
+ */
+struct cache *
+cache_open(const char *path)
+{
+	struct cache *c;
+	unsigned long long magic = 0;
+	size_t size;
+	void *p;
+
+	size = sizeof(struct cache_header) +
+	    CACHE_SLOTS * sizeof(struct cache_entry);
+	if (path != NULL)
+		p = map_file(path, size);
+	else if ((p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANON, -1, 0)) == MAP_FAILED)
+		errx(1, "Couldn't allocate cache");
+	if (p == NULL)
+		return NULL;
+
+	if ((c = malloc(sizeof(*c))) == NULL)
+		errx(1, "Couldn't allocate cache");
+	c->header = p;
+	c->entries = (struct cache_entry *)(c->header + 1);
+	c->size = size;
+
+	/* Table of zeroes is valid empty table, so magic may come late */
+	if (!atomic_compare_exchange_strong(&c->header->magic, &magic,
+	    CACHE_MAGIC) && magic != CACHE_MAGIC) {
+		warnx("%s: not a cache file", path);
+		cache_close(c);
+		return NULL;
+	}
+
+	return c;
+}
+
+void
+cache_close(struct cache *c)
+{
+	munmap(c->header, c->size);
+	free(c);
+}
+
+/*
+ * Look for result of expression with hashes key and check. Returns 1
+ * and fills value and error if it is found
+ */
+int
+cache_lookup(struct cache *c, unsigned long long key,
+    unsigned long long check, long long int *value, int *error)
+{
+	struct cache_entry *e;
+	unsigned long long k;
+	unsigned int state;
+
+	for (int i = 0; i < CACHE_PROBES; i++) {
+		e = &c->entries[(key + i) & (CACHE_SLOTS - 1)];
+		k = atomic_load_explicit(&e->key, memory_order_relaxed);
+		if (k == 0)
+			return 0;
+		if (k != key)
+			continue;
+		state = atomic_load_explicit(&e->state, memory_order_acquire);
+		if (state == 0 || atomic_load_explicit(&e->check,
+		    memory_order_relaxed) != check)
+			return 0;
+		*value = atomic_load_explicit(&e->value,
+		    memory_order_relaxed);
+		*error = state - 1;
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Store result of expression. Nothing is stored if every probed slot
+ * is taken by other expressions
+ */
+void
+cache_store(struct cache *c, unsigned long long key,
+    unsigned long long check, long long int value, int error)
+{
+	struct cache_entry *e;
+	unsigned long long k;
+
+	for (int i = 0; i < CACHE_PROBES; i++) {
+		e = &c->entries[(key + i) & (CACHE_SLOTS - 1)];
+		k = 0;
+		if (!atomic_compare_exchange_strong_explicit(&e->key, &k, key,
+		    memory_order_relaxed, memory_order_relaxed)) {
+			if (k == key)
+				return; /* Somebody else stores it */
+			continue;
+		}
+		atomic_store_explicit(&e->check, check, memory_order_relaxed);
+		atomic_store_explicit(&e->value, value, memory_order_relaxed);
+		atomic_store_explicit(&e->state, error + 1,
+		    memory_order_release);
+		return;
+	}
+}
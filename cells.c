@@ -0,0 +1,513 @@
+/*
+ * Copyright © 2022 — 2023 Artsiom Karakin <karakin2000@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Files of named cells, one per line:
+ *	a = 3 * 4
+ *	b = ( a + 7 ) / 2
+ * Lines without name are evaluated too, "#" starts a comment.
+ * Ranges declared for cell names let range analysis drop overflow
+ * checks from cells which use them, values out of range are errors.
+ * Cells are evaluated in dependency order. In watch mode file is
+ * reread when it changes and only changed cells and cells depending
+ * on them are recomputed.
+ */
+#include "argcalc.h"
+
+#include <ctype.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/inotify.h>
+#endif
+
+struct cell {
+	int sym; /* Symbol of cell name or -1 if it has no name */
+	int line;
+	char *src; /* Expression text */
+	struct program prog;
+	long long int *frame;
+	int parse_error;
+	long long int value;
+	int error;
+	int dirty;
+	int mark; /* State of search while sorting, 2 if done */
+	int index;
+	int low;
+	int next; /* Next variable to follow while sorting */
+	int cycle; /* Cell is part of circular dependency */
+};
+
+struct sheet {
+	struct cell *cells;
+	int ncells;
+	int *order; /* Cell indexes in dependency order */
+	int norder;
+	int *owner; /* Cell defining symbol or -1, indexed by symbol */
+	long long int *values; /* Cell values indexed by symbol */
+	int nsyms;
+};
+
+static void
+free_cell(struct cell *c)
+{
+	free(c->src);
+	free(c->frame);
+	free_program(&c->prog);
+}
+
+static void
+free_sheet(struct sheet *sh)
+{
+	for (int i = 0; i < sh->ncells; i++)
+		free_cell(&sh->cells[i]);
+	free(sh->cells);
+	free(sh->order);
+	free(sh->owner);
+	free(sh->values);
+	memset(sh, 0, sizeof(*sh));
+}
+
+/*
+ * Split line into cell name and expression. Name is identifier
+ * before "=", which is not "==", if there is no such name whole line
+ * is expression
+ */
+static void
+split_line(struct cell *c, char *line)
+{
+	char *eq, *name, *end;
+	size_t len;
+
+	c->sym = -1;
+	if ((eq = strchr(line, '#')) != NULL)
+		*eq = '\0';
+	if ((eq = strchr(line, '=')) != NULL) {
+		for (name = line; isspace((unsigned char)*name); name++)
+			;
+		for (end = name; isalnum((unsigned char)*end) ||
+		    *end == '_'; end++)
+			;
+		len = end - name;
+		while (isspace((unsigned char)*end))
+			end++;
+		if (len > 0 && !isdigit((unsigned char)*name) && end == eq &&
+		    eq[1] != '=') {
+			c->sym = intern_symbol(name, len);
+			line = eq + 1;
+		}
+	}
+	if ((c->src = strdup(line)) == NULL)
+		errx(1, "Couldn't allocate cell");
+	c->src[strcspn(c->src, "\n")] = '\0';
+}
+
+/*
+ * Parse and compile expression of the cell
+ */
+static void
+compile_cell(struct cell *c)
+{
+	if ((c->parse_error = parse_expression(c->src,
+	    strlen(c->src))) != CALC_OK)
+		return;
+	compile_rpn(&c->prog);
+	c->frame = frame_alloc(&c->prog);
+}
+
+/*
+ * Read cells from file at path, cells are not compiled
+ */
+static void
+read_sheet(const char *path, struct sheet *sh)
+{
+	FILE *fp;
+	char *line = NULL, *p;
+	size_t line_size = 0;
+	struct cell *c;
+	int lineno = 0, size = 0;
+
+	memset(sh, 0, sizeof(*sh));
+	if ((fp = fopen(path, "r")) == NULL)
+		err(1, "%s", path);
+
+	while (getline(&line, &line_size, fp) != -1) {
+		lineno++;
+		for (p = line; isspace((unsigned char)*p); p++)
+			;
+		if (*p == '\0' || *p == '#')
+			continue;
+		if (sh->ncells == size) {
+			size = size ? size * 2 : 64;
+			if ((c = reallocarray(sh->cells, size,
+			    sizeof(*c))) == NULL)
+				errx(1, "Couldn't grow cells");
+			sh->cells = c;
+		}
+		c = &sh->cells[sh->ncells++];
+		memset(c, 0, sizeof(*c));
+		c->line = lineno;
+		c->prog.result = -1;
+		split_line(c, line);
+	}
+	if (ferror(fp))
+		err(1, "%s", path);
+	free(line);
+	fclose(fp);
+}
+
+/*
+ * Make symbol map big enough for every symbol interned so far
+ */
+static void
+grow_symbols(struct sheet *sh)
+{
+	int n = symbol_count();
+
+	if (n <= sh->nsyms)
+		return;
+	if ((sh->owner = reallocarray(sh->owner, n,
+	    sizeof(*sh->owner))) == NULL ||
+	    (sh->values = reallocarray(sh->values, n,
+	    sizeof(*sh->values))) == NULL)
+		errx(1, "Couldn't allocate symbol map");
+	for (int i = sh->nsyms; i < n; i++) {
+		sh->owner[i] = -1;
+		sh->values[i] = 0;
+	}
+	sh->nsyms = n;
+}
+
+/*
+ * Build symbol to cell map, symbols defined twice are errors
+ */
+static void
+map_symbols(struct sheet *sh)
+{
+	struct cell *c;
+
+	grow_symbols(sh);
+	for (int i = 0; i < sh->ncells; i++) {
+		c = &sh->cells[i];
+		if (c->sym < 0)
+			continue;
+		if (sh->owner[c->sym] >= 0)
+			c->parse_error = CALC_REDEFINED;
+		else
+			sh->owner[c->sym] = i;
+	}
+}
+
+/*
+ * Start search from cell i, see visit
+ */
+static void
+enter(struct sheet *sh, int i, int *index, int *stack, int *top)
+{
+	struct cell *c = &sh->cells[i];
+
+	c->index = c->low = (*index)++;
+	c->mark = 1;
+	c->next = 0;
+	c->cycle = 0; /* Set if cell depends on itself */
+	stack[(*top)++] = i;
+}
+
+/*
+ * Tarjan's search of strongly connected components from cell root.
+ * Components are appended to order after every cell they depend on,
+ * cells of component with more than one cell or depending on itself
+ * are on a cycle. Chains of dependencies may be as long as the sheet,
+ * so cells being searched are kept in calls instead of C stack
+ */
+static void
+visit(struct sheet *sh, int root, int *index, int *stack, int *top,
+    int *calls)
+{
+	struct cell *c, *d;
+	int ncalls = 0, i, dep, cycle, j;
+
+	enter(sh, root, index, stack, top);
+	calls[ncalls++] = root;
+	while (ncalls > 0) {
+		i = calls[ncalls - 1];
+		c = &sh->cells[i];
+		if (c->next < c->prog.nvars) {
+			if ((dep = sh->owner[c->prog.vars[c->next++]]) < 0)
+				continue;
+			d = &sh->cells[dep];
+			if (dep == i)
+				c->cycle = 1;
+			if (d->mark == 0) {
+				enter(sh, dep, index, stack, top);
+				calls[ncalls++] = dep;
+			} else if (d->mark == 1 && d->index < c->low)
+				c->low = d->index;
+			continue;
+		}
+
+		/* Every dependency is searched, back to the caller */
+		if (--ncalls > 0 && c->low < sh->cells[calls[ncalls - 1]].low)
+			sh->cells[calls[ncalls - 1]].low = c->low;
+		if (c->low != c->index)
+			continue;
+		cycle = c->cycle || stack[*top - 1] != i;
+		do {
+			j = stack[--(*top)];
+			sh->cells[j].mark = 2;
+			sh->cells[j].cycle = cycle;
+			sh->order[sh->norder++] = j;
+		} while (j != i);
+	}
+}
+
+static void
+sort_sheet(struct sheet *sh)
+{
+	int *stack, *calls, index = 0, top = 0;
+	size_t n = sh->ncells ? sh->ncells : 1;
+
+	if ((sh->order = reallocarray(NULL, n, sizeof(*sh->order))) == NULL ||
+	    (stack = reallocarray(NULL, n, sizeof(*stack))) == NULL ||
+	    (calls = reallocarray(NULL, n, sizeof(*calls))) == NULL)
+		errx(1, "Couldn't allocate cell order");
+	for (int i = 0; i < sh->ncells; i++)
+		if (sh->cells[i].mark == 0)
+			visit(sh, i, &index, stack, &top, calls);
+	free(calls);
+	free(stack);
+}
+
+/*
+ * Evaluate one cell, all cells it depends on are already evaluated
+ */
+static void
+eval_cell(struct sheet *sh, struct cell *c)
+{
+	struct cell *dep;
+	struct range r;
+	int owner;
+
+	if (c->cycle) {
+		c->error = CALC_CYCLE;
+		return;
+	}
+	if ((c->error = c->parse_error) != CALC_OK)
+		return;
+	for (int v = 0; v < c->prog.nvars; v++) {
+		if ((owner = sh->owner[c->prog.vars[v]]) < 0) {
+			c->error = CALC_UNKNOWN;
+			return;
+		}
+		dep = &sh->cells[owner];
+		if (dep->error != CALC_OK) {
+			c->error = CALC_DEPENDENCY;
+			return;
+		}
+		sh->values[c->prog.vars[v]] = dep->value;
+	}
+	frame_bind(&c->prog, c->frame, sh->values);
+	c->error = run_program(&c->prog, c->frame, &c->value);
+	if (c->error == CALC_OK && c->prog.result < 0)
+		c->error = CALC_STACK;
+	/* Programs of dependent cells rely on declared range */
+	if (c->error == CALC_OK && c->sym >= 0 &&
+	    symbol_range(c->sym, &r) && (c->value < r.lo || c->value > r.hi))
+		c->error = CALC_DECLARED;
+}
+
+static void
+print_cell(const struct cell *c)
+{
+	char buf[32];
+
+	format_value(buf, sizeof(buf), c->value, get_scale());
+	if (c->error != CALC_OK)
+		warnx("line %d: %s%s%s", c->line,
+		    c->sym >= 0 ? symbol_name(c->sym) : "",
+		    c->sym >= 0 ? ": " : "", calc_strerror(c->error));
+	else if (c->sym >= 0)
+		printf("%s = %s\n", symbol_name(c->sym), buf);
+	else
+		printf("%s\n", buf);
+}
+
+/*
+ * Evaluate dirty cells in dependency order and print them in order
+ * of the file. Returns number of failed cells
+ */
+static int
+recompute(struct sheet *sh)
+{
+	int failed = 0;
+
+	for (int i = 0; i < sh->norder; i++)
+		if (sh->cells[sh->order[i]].dirty)
+			eval_cell(sh, &sh->cells[sh->order[i]]);
+	for (int i = 0; i < sh->ncells; i++) {
+		if (!sh->cells[i].dirty)
+			continue;
+		print_cell(&sh->cells[i]);
+		if (sh->cells[i].error != CALC_OK)
+			failed++;
+		sh->cells[i].dirty = 0;
+	}
+	fflush(stdout);
+
+	return failed;
+}
+
+/*
+ * Load sheet, taking compiled programs and values of unchanged cells
+ * from old sheet. Changed cells and everything depending on them are
+ * marked dirty
+ */
+static void
+reload_sheet(const char *path, struct sheet *sh, struct sheet *old)
+{
+	struct cell *c, *o;
+	int owner, found;
+
+	read_sheet(path, sh);
+	map_symbols(sh);
+
+	for (int i = 0; i < sh->ncells; i++) {
+		c = &sh->cells[i];
+		c->dirty = 1;
+		found = 0;
+		if (old != NULL && c->parse_error == CALC_OK) {
+			/* Unnamed cells are matched by position */
+			if (c->sym >= 0) {
+				owner = c->sym < old->nsyms ?
+				    old->owner[c->sym] : -1;
+				found = owner >= 0;
+			} else {
+				owner = i;
+				found = i < old->ncells &&
+				    old->cells[i].sym < 0;
+			}
+			found = found &&
+			    strcmp(c->src, old->cells[owner].src) == 0;
+		}
+		if (!found) {
+			if (c->parse_error == CALC_OK)
+				compile_cell(c);
+			continue;
+		}
+		o = &old->cells[owner];
+		c->prog = o->prog;
+		c->frame = o->frame;
+		c->parse_error = o->parse_error;
+		c->value = o->value;
+		c->error = o->error;
+		c->dirty = 0;
+		o->frame = NULL;
+		memset(&o->prog, 0, sizeof(o->prog));
+	}
+
+	/* Compiled cells may refer to names which are not cells */
+	grow_symbols(sh);
+
+	/* Cells which were or became part of a cycle are recomputed */
+	for (int i = 0; i < sh->ncells; i++)
+		if (sh->cells[i].error == CALC_CYCLE)
+			sh->cells[i].dirty = 1;
+	sort_sheet(sh);
+
+	/* Dependencies come first in order, so one pass is enough */
+	for (int i = 0; i < sh->norder; i++) {
+		c = &sh->cells[sh->order[i]];
+		if (c->cycle)
+			c->dirty = 1;
+		for (int v = 0; v < c->prog.nvars && !c->dirty; v++) {
+			owner = sh->owner[c->prog.vars[v]];
+			if (owner < 0 || sh->cells[owner].dirty)
+				c->dirty = 1;
+		}
+	}
+}
+
+#if defined(__linux__)
+/*
+ * Wait for file to be written or replaced and recompute what changed.
+ * Directory is watched, so editors replacing file by rename are seen
+ */
+static void
+watch_sheet(const char *path, struct sheet *sh)
+{
+	char buf[4096]
+	    __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	struct sheet new;
+	char *dir, *base;
+	ssize_t n;
+	int fd, changed;
+
+	if ((dir = strdup(path)) == NULL || (base = strdup(path)) == NULL)
+		errx(1, "Couldn't allocate path");
+	if ((fd = inotify_init1(IN_CLOEXEC)) == -1)
+		err(1, "inotify_init1");
+	if (inotify_add_watch(fd, dirname(dir),
+	    IN_CLOSE_WRITE | IN_MOVED_TO) == -1)
+		err(1, "%s", dir);
+	base = basename(base);
+
+	for (;;) {
+		if ((n = read(fd, buf, sizeof(buf))) == -1)
+			err(1, "read inotify");
+		changed = 0;
+		for (char *p = buf; p < buf + n; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			if (ev->len > 0 && strcmp(ev->name, base) == 0)
+				changed = 1;
+		}
+		if (!changed || access(path, R_OK) == -1)
+			continue;
+		reload_sheet(path, &new, sh);
+		free_sheet(sh);
+		*sh = new;
+		recompute(sh);
+	}
+}
+#endif
+
+/*
+ * Evaluate every cell of file at path, then keep recomputing
+ * changed cells if watch is set
+ */
+int
+run_cells(const char *path, int watch)
+{
+	struct sheet sh;
+	int failed;
+
+	reload_sheet(path, &sh, NULL);
+	failed = recompute(&sh);
+	if (watch) {
+#if defined(__linux__)
+		watch_sheet(path, &sh);
+#else
+		errx(1, "Watch mode needs inotify");
+#endif
+	}
+	free_sheet(&sh);
+
+	return failed > 0;
+}
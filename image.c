@@ -0,0 +1,358 @@
+/*
+ * Copyright © 2022 — 2023 Artsiom Karakin <karakin2000@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Images of compiled programs, which are run without parsing. Image is
+ * laid out so it runs right where it is mapped:
+ *
+ *	struct image	header
+ *	frame		nframe long longs, literals followed by zeroes
+ *	code		ncode instructions as struct insn
+ *	variables	nvars offsets of names of variables
+ *	names		names of variables ending with NUL
+ *
+ * Private writable mapping of image is a frame of its own, writes to it
+ * are copied on write and never reach the file. Numbers are in byte
+ * order of machine which wrote image, other machines refuse to run it.
+ * Ranges which proved unchecked operations safe aren't in image, so it
+ * has checked ones instead.
+ */
+#include "argcalc.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define IMAGE_MAGIC	"argcalc"
+#define IMAGE_VERSION	3
+#define IMAGE_ORDER	0x01020304 /* Reads differently in other order */
+
+struct image {
+	char magic[8];
+	unsigned int version;
+	unsigned int order;
+	unsigned int insn_size;
+	int ncode;
+	int nlits;
+	int nvars;
+	int nregs;
+	int nframe;
+	int result;
+	int policy;
+	int scale;
+	unsigned int names_size;
+	unsigned long long mod_n; /* Other constants are computed from it */
+};
+
+/*
+ * Write program compiled from expression in file at path, see
+ * load_expression, into image at out
+ */
+int
+compile_image(const char *path, int jobs, const char *out)
+{
+	struct program prog;
+	struct image h;
+	struct insn insn;
+	unsigned int off = 0;
+	long long int *frame;
+	FILE *f;
+
+	load_expression(path, jobs, &prog);
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+	h.version = IMAGE_VERSION;
+	h.order = IMAGE_ORDER;
+	h.insn_size = sizeof(struct insn);
+	h.ncode = prog.ncode;
+	h.nlits = prog.nlits;
+	h.nvars = prog.nvars;
+	h.nregs = prog.nregs;
+	h.nframe = prog.nframe;
+	h.result = prog.result;
+	h.policy = prog.policy;
+	h.scale = prog.scale;
+	for (int i = 0; i < prog.nvars; i++)
+		h.names_size += strlen(symbol_name(prog.vars[i])) + 1;
+	h.mod_n = prog.mod.n;
+
+	if ((f = fopen(out, "w")) == NULL)
+		err(1, "%s", out);
+	frame = frame_alloc(&prog);
+	fwrite(&h, sizeof(h), 1, f);
+	fwrite(frame, sizeof(*frame), prog.nframe, f);
+	/* Padding of instructions is zeroed, so images are reproducible */
+	for (int i = 0; i < prog.ncode; i++) {
+		memset(&insn, 0, sizeof(insn));
+		insn.op = checked_op(prog.code[i].op);
+		insn.aux = prog.code[i].aux;
+		insn.dst = prog.code[i].dst;
+		insn.a = prog.code[i].a;
+		insn.b = prog.code[i].b;
+		fwrite(&insn, sizeof(insn), 1, f);
+	}
+	for (int i = 0; i < prog.nvars; i++) {
+		fwrite(&off, sizeof(off), 1, f);
+		off += strlen(symbol_name(prog.vars[i])) + 1;
+	}
+	for (int i = 0; i < prog.nvars; i++)
+		fwrite(symbol_name(prog.vars[i]),
+		    strlen(symbol_name(prog.vars[i])) + 1, 1, f);
+	if (ferror(f) || fclose(f) == EOF)
+		err(1, "%s", out);
+
+	free(frame);
+	free_program(&prog);
+	return 0;
+}
+
+/*
+ * Magic number and aux of OP_MDIV are what divisor_init makes for some
+ * divisor d, so the instruction divides by d and can't fail. Magic
+ * number is 2^(64 + shift) / |d| + 1
+ */
+static int
+valid_magic(long long int magic, unsigned char aux)
+{
+	struct divisor dv;
+	unsigned __int128 ad;
+	unsigned long long m;
+	long long int d;
+	int neg;
+
+	if ((aux & DIV_ADD) && (aux & DIV_SUB))
+		return 0;
+	neg = (aux & DIV_SUB) || (magic < 0 && !(aux & DIV_ADD));
+	m = neg ? -(unsigned long long)magic : (unsigned long long)magic;
+	if (m == 0)
+		return 0;
+	ad = ((unsigned __int128)1 << (64 + (aux & DIV_SHIFT))) / m + 1;
+	if (ad > (neg ? (unsigned long long)LLONG_MAX + 1 : LLONG_MAX))
+		return 0;
+	d = neg ? (long long int)-(unsigned long long)ad : (long long int)ad;
+	return divisor_init(&dv, d) && dv.magic == magic && dv.aux == aux;
+}
+
+/*
+ * Instruction refers only to frame and jumps only forward, so it is
+ * safe to run, whatever image it comes from. Unchecked operations
+ * aren't, see compile_image
+ */
+static int
+valid_insn(const struct program *p, const struct insn *ip)
+{
+	int i = ip - p->code;
+
+	switch (ip->op) {
+	case OP_TRAP:
+		return ip->aux != CALC_OK && ip->aux <= CALC_CONDITIONAL;
+	case OP_JMP:
+		return ip->dst > i && ip->dst <= p->ncode;
+	case OP_JZ:
+		return ip->dst > i && ip->dst <= p->ncode &&
+		    ip->a >= 0 && ip->a < p->nframe;
+	case OP_MOV:
+		return ip->dst >= p->nlits && ip->dst < p->nframe &&
+		    ip->a >= 0 && ip->a < p->nframe;
+	case OP_LT:
+	case OP_GT:
+	case OP_LE:
+	case OP_GE:
+	case OP_EQ:
+	case OP_NE:
+		/* Images have no denominators */
+		if (ip->aux > CMP_RESIDUE ||
+		    (ip->aux == CMP_RESIDUE && p->mod.n == 0))
+			return 0;
+		break;
+	case OP_FADD:
+	case OP_FSUB:
+	case OP_FMUL:
+	case OP_FDIV:
+		return 0;
+	case OP_MDIV:
+		if (ip->b < 0 || ip->b >= p->nlits ||
+		    !valid_magic(p->lits[ip->b], ip->aux))
+			return 0;
+		break;
+	case OP_DMUL:
+	case OP_DDIV:
+		if (ip->aux > MAX_SCALE)
+			return 0;
+		break;
+	case OP_MODADD:
+	case OP_MODSUB:
+	case OP_MODMUL:
+	case OP_MODDIV:
+		if (p->mod.n == 0)
+			return 0;
+		break;
+	default:
+		if (ip->op > OP_JMP)
+			return 0;
+		break;
+	}
+	return ip->dst >= p->nlits && ip->dst < p->nframe &&
+	    ip->a >= 0 && ip->a < p->nframe &&
+	    ip->b >= 0 && ip->b < p->nframe;
+}
+
+/*
+ * Make program run code of image of size bytes at base in place.
+ * Offsets of names of variables go to *vars. Returns NULL or
+ * description of what is wrong with image
+ */
+static const char *
+load_image(char *base, size_t size, struct program *p,
+    const unsigned int **vars)
+{
+	const struct image *h = (const struct image *)base;
+	size_t need;
+	const char *names;
+
+	if (size < sizeof(*h) ||
+	    memcmp(h->magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) != 0)
+		return "not an image";
+	if (h->version != IMAGE_VERSION)
+		return "image of other version";
+	if (h->order != IMAGE_ORDER || h->insn_size != sizeof(struct insn))
+		return "image of other machine";
+	if (h->ncode < 0 || h->nlits < 0 || h->nvars < 0 || h->nregs < 0 ||
+	    h->nframe != (long long int)h->nlits + h->nvars + h->nregs ||
+	    h->result < -1 || h->result >= h->nframe ||
+	    h->policy < 0 || h->policy >= POLICY_COUNT ||
+	    h->scale < 0 || h->scale > MAX_SCALE ||
+	    (h->mod_n != 0 && (h->mod_n < 2 || h->mod_n > LLONG_MAX ||
+	    h->scale != 0)))
+		return "damaged image";
+	need = sizeof(*h) + (size_t)h->nframe * sizeof(long long int) +
+	    (size_t)h->ncode * sizeof(struct insn) +
+	    (size_t)h->nvars * sizeof(unsigned int) + h->names_size;
+	if (size != need)
+		return "damaged image";
+
+	memset(p, 0, sizeof(*p));
+	p->lits = (long long int *)(base + sizeof(*h));
+	p->code = (struct insn *)(p->lits + h->nframe);
+	*vars = (const unsigned int *)(p->code + h->ncode);
+	names = (const char *)(*vars + h->nvars);
+	p->ncode = h->ncode;
+	p->nlits = h->nlits;
+	p->nvars = h->nvars;
+	p->nregs = h->nregs;
+	p->nframe = h->nframe;
+	p->result = h->result;
+	p->policy = h->policy;
+	p->scale = h->scale;
+	init_modulus(&p->mod, h->mod_n);
+
+	for (int i = 0; i < p->ncode; i++)
+		if (!valid_insn(p, &p->code[i]))
+			return "damaged image";
+	/* Names end before the end of image */
+	if (h->names_size > 0 && names[h->names_size - 1] != '\0')
+		return "damaged image";
+	for (int i = 0; i < p->nvars; i++)
+		if ((*vars)[i] >= h->names_size)
+			return "damaged image";
+	return NULL;
+}
+
+/*
+ * Run program in image at path with variables set by "name=value"
+ * words of argv, print result like expression would print it
+ */
+int
+run_image(const char *path, int argc, char **argv)
+{
+	struct program prog;
+	struct stat st;
+	const unsigned int *vars;
+	const char *errstr, *names, *name, *eq;
+	long long int *frame, result;
+	char *base, buf[32];
+	size_t len;
+	int fd, error, i, j;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		err(1, "%s", path);
+	if (fstat(fd, &st) == -1)
+		err(1, "%s", path);
+	if ((len = st.st_size) == 0)
+		errx(1, "%s: not an image", path);
+	if ((base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+	    fd, 0)) == MAP_FAILED)
+		err(1, "%s", path);
+	close(fd);
+	if ((errstr = load_image(base, len, &prog, &vars)) != NULL)
+		errx(1, "%s: %s", path, errstr);
+	frame = prog.lits;
+	names = (const char *)(vars + prog.nvars);
+
+	/* Every word sets some variable and every variable is set */
+	for (j = 0; j < argc; j++) {
+		if ((eq = strchr(argv[j], '=')) == NULL)
+			errx(1, "\"%s\" is not name=value", argv[j]);
+		for (i = 0; i < prog.nvars; i++) {
+			name = names + vars[i];
+			if (strncmp(argv[j], name, eq - argv[j]) == 0 &&
+			    name[eq - argv[j]] == '\0')
+				break;
+		}
+		if (i == prog.nvars)
+			errx(1, "Unknown variable %.*s", (int)(eq - argv[j]),
+			    argv[j]);
+		/* Integers are parsed as in expressions, without point */
+		if (prog.scale == 0)
+			frame[prog.nlits + i] = strtonum(eq + 1, LLONG_MIN,
+			    LLONG_MAX, &errstr);
+		else
+			errstr = parse_decimal(eq + 1, prog.scale,
+			    &frame[prog.nlits + i]);
+		if (errstr != NULL)
+			errx(1, "number \"%s\" is %s", eq + 1, errstr);
+		if (prog.mod.n != 0)
+			frame[prog.nlits + i] = to_residue(&prog.mod,
+			    frame[prog.nlits + i]);
+	}
+	for (i = 0; i < prog.nvars; i++) {
+		name = names + vars[i];
+		for (j = 0; j < argc; j++)
+			if (strncmp(argv[j], name, strlen(name)) == 0 &&
+			    argv[j][strlen(name)] == '=')
+				break;
+		if (j == argc)
+			errx(1, "Variable %s has no value", name);
+	}
+
+	if ((error = run_program(&prog, frame, &result)) != CALC_OK)
+		errx(1, "%s", calc_strerror(error));
+	if (prog.result >= 0) {
+		set_scale(prog.scale);
+		set_modulus(prog.mod.n);
+		format_value(buf, sizeof(buf), result, prog.scale);
+		printf("%s \n", buf);
+	}
+	munmap(base, len);
+	return 0;
+}
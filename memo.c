@@ -0,0 +1,241 @@
+/*
+ * Copyright © 2022 — 2023 Artsiom Karakin <karakin2000@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * Evaluation with memo of subexpressions. Every instruction computes
+ * value of subtree of expression, which is identified by hash of its
+ * operators and literals no matter what line it came from. Results of
+ * subtrees are kept in cache, so repeated subtree is evaluated once.
+ * Subtrees are visited in the same order as run_program executes
+ * them, so failing expression reports the same error.
+ */
+#include "argcalc.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Smaller subtrees are cheaper to evaluate than to look up */
+#define MEMO_MIN_NODES	2
+
+enum { VISIT_LEFT, VISIT_RIGHT, VISIT_SELF };
+
+void
+memo_init(struct memo *m, struct cache *c)
+{
+	memset(m, 0, sizeof(*m));
+	m->cache = c;
+}
+
+void
+memo_free(struct memo *m)
+{
+	free(m->producer);
+	free(m->hash);
+	free(m->check);
+	free(m->left);
+	free(m->right);
+	free(m->size);
+	free(m->state);
+	free(m->stack);
+	memset(m, 0, sizeof(*m));
+}
+
+static void *
+grow_scratch(void *p, int n, size_t elsize)
+{
+	if ((p = reallocarray(p, n, elsize)) == NULL)
+		errx(1, "Couldn't grow memo");
+	return p;
+}
+
+/*
+ * Add x to pair of hashes, the same way hash_tokens does
+ */
+static void
+mix(unsigned long long *h, unsigned long long *c, unsigned long long x)
+{
+	unsigned long long y;
+
+	*h = (*h ^ x) * 0x100000001b3ULL;
+	y = *c + x * 0x9e3779b97f4a7c15ULL;
+	y = (y ^ (y >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	y = (y ^ (y >> 27)) * 0x94d049bb133111ebULL;
+	*c = (*c << 7 | *c >> 57) ^ y ^ (y >> 31);
+}
+
+/*
+ * Mix value in frame slot: result of instruction or literal
+ */
+static void
+mix_slot(const struct memo *m, const struct program *p, int slot,
+    unsigned long long *h, unsigned long long *c)
+{
+	int i = m->producer[slot];
+
+	if (i >= 0) {
+		mix(h, c, m->hash[i]);
+		mix(h, c, m->check[i]);
+	} else {
+		mix(h, c, 'l');
+		mix(h, c, (unsigned long long)p->lits[slot]);
+	}
+}
+
+/*
+ * Find operands of every instruction and hash its subtree. Returns 0
+ * for programs with conditionals, they aren't trees of instructions
+ */
+static int
+prepare(struct memo *m, const struct program *p)
+{
+	const struct insn *ip;
+	unsigned long long h, c;
+
+	if (p->nframe > m->frame_size) {
+		m->frame_size = p->nframe;
+		m->producer = grow_scratch(m->producer, m->frame_size,
+		    sizeof(*m->producer));
+	}
+	if (p->ncode > m->code_size) {
+		m->code_size = p->ncode;
+		m->hash = grow_scratch(m->hash, m->code_size,
+		    sizeof(*m->hash));
+		m->check = grow_scratch(m->check, m->code_size,
+		    sizeof(*m->check));
+		m->left = grow_scratch(m->left, m->code_size,
+		    sizeof(*m->left));
+		m->right = grow_scratch(m->right, m->code_size,
+		    sizeof(*m->right));
+		m->size = grow_scratch(m->size, m->code_size,
+		    sizeof(*m->size));
+		m->state = grow_scratch(m->state, m->code_size,
+		    sizeof(*m->state));
+		m->stack = grow_scratch(m->stack, m->code_size,
+		    sizeof(*m->stack));
+	}
+	for (int i = 0; i < p->nframe; i++)
+		m->producer[i] = -1;
+
+	for (int i = 0; i < p->ncode; i++) {
+		ip = &p->code[i];
+		m->left[i] = m->right[i] = -1;
+		m->size[i] = 1;
+		m->state[i] = 0; /* Root until some instruction uses it */
+		m->hash[i] = m->check[i] = 0;
+		if (ip->op == OP_JZ || ip->op == OP_JMP)
+			return 0;
+		if (ip->op == OP_TRAP)
+			continue;
+		h = 0xcbf29ce484222325ULL;
+		c = 0;
+		mix(&h, &c, p->policy);
+		mix(&h, &c, ip->op);
+		mix(&h, &c, ip->aux);
+		mix_slot(m, p, ip->a, &h, &c);
+		mix_slot(m, p, ip->b, &h, &c);
+		m->hash[i] = h != 0 ? h : 1;
+		m->check[i] = c;
+		if ((m->left[i] = m->producer[ip->a]) >= 0) {
+			m->size[i] += m->size[m->left[i]];
+			m->state[m->left[i]] = 1;
+		}
+		if ((m->right[i] = m->producer[ip->b]) >= 0) {
+			m->size[i] += m->size[m->right[i]];
+			m->state[m->right[i]] = 1;
+		}
+		m->producer[ip->dst] = i;
+	}
+	return 1;
+}
+
+/*
+ * Evaluate subtree with root instruction, taking results of its
+ * subtrees from cache when they are there
+ */
+static int
+eval_tree(struct memo *m, const struct program *p, long long int *frame,
+    int root)
+{
+	long long int value;
+	int i, n = 0, error;
+
+	m->stack[n++] = root;
+	m->state[root] = VISIT_LEFT;
+	while (n > 0) {
+		i = m->stack[n - 1];
+		switch (m->state[i]++) {
+		case VISIT_LEFT:
+			if (m->size[i] >= MEMO_MIN_NODES) {
+				m->stats.nodes++;
+				if (cache_lookup(m->cache, m->hash[i],
+				    m->check[i], &value, &error)) {
+					m->stats.node_hits++;
+					if (error != CALC_OK)
+						return error;
+					frame[p->code[i].dst] = value;
+					n--;
+					break;
+				}
+			}
+			if (m->left[i] >= 0) {
+				m->stack[n++] = m->left[i];
+				m->state[m->left[i]] = VISIT_LEFT;
+			}
+			break;
+		case VISIT_RIGHT:
+			if (m->right[i] >= 0) {
+				m->stack[n++] = m->right[i];
+				m->state[m->right[i]] = VISIT_LEFT;
+			}
+			break;
+		default:
+			error = run_insn(p, &p->code[i], frame);
+			if (m->size[i] >= MEMO_MIN_NODES)
+				cache_store(m->cache, m->hash[i], m->check[i],
+				    frame[p->code[i].dst], error);
+			if (error != CALC_OK)
+				return error;
+			n--;
+		}
+	}
+	return CALC_OK;
+}
+
+/*
+ * Evaluate program without variables like run_program does, reusing
+ * results of subexpressions evaluated before. Programs with variables
+ * or conditionals are just run
+ */
+int
+memo_run(struct memo *m, const struct program *p, long long int *frame,
+    long long int *res)
+{
+	int error;
+
+	if (p->nvars > 0 || !prepare(m, p))
+		return run_program(p, frame, res);
+	/* Roots are left unmarked by prepare, evaluated ones are marked */
+	for (int i = 0; i < p->ncode; i++) {
+		if (m->state[i] != 0)
+			continue;
+		if ((error = eval_tree(m, p, frame, i)) != CALC_OK)
+			return error;
+	}
+	if (p->result >= 0)
+		*res = frame[p->result];
+	return CALC_OK;
+}
@@ -0,0 +1,465 @@
+/*
+ * Copyright © 2022 — 2023 Artsiom Karakin <karakin2000@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Single expression read from file, which may be too big to parse on
+ * one core. Text is split into chunks at white space, and every chunk
+ * is handled by its own thread:
+ *
+ * 1. Words of chunk are turned into tokens, which go right through
+ *    shunting yard on operator stack of chunk. Operator which would
+ *    look below the bottom of it is put off, as only preceding chunks
+ *    know what is there. Changes of bracket depth are counted on the
+ *    way.
+ * 2. Prefix sum of depth changes gives depth at start of every chunk,
+ *    so unbalanced brackets are found before stitching.
+ * 3. RPN of chunks is stitched in order on one operator stack, which
+ *    gets operators left by every chunk and handles those put off,
+ *    and is compiled on the way. This is done by one thread.
+ *
+ * Anything unusual, like variables or syntax errors, makes expression
+ * parsed again by the usual sequential code, so errors are the same.
+ */
+#include "argcalc.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CHUNK_MIN	(64 * 1024) /* Smaller chunks aren't worth thread */
+#define DEFERRED	0x100 /* Token type flag of operator put off */
+#define PUT_OFF		(-1) /* Result of yard_step for such operator */
+
+/* Growable array of tokens */
+struct tokens {
+	struct token *v;
+	size_t n;
+	size_t size;
+};
+
+/*
+ * Operator stack of shunting yard. Open stack continues below bottom
+ * in preceding chunks
+ */
+struct yard {
+	int *stack;
+	size_t depth;
+	size_t size;
+	int open;
+	struct tokens out;
+};
+
+struct chunk {
+	const char *start;
+	const char *end;
+	struct yard yard;
+	long depth_change; /* Bracket depth at end relative to start */
+	long min_depth; /* Lowest depth relative to start */
+	int failed;
+	pthread_t thread;
+};
+
+static void
+reserve(struct tokens *t, size_t n)
+{
+	struct token *v;
+	size_t size;
+
+	if (t->n + n <= t->size)
+		return;
+	size = t->size ? t->size : 1024;
+	while (size < t->n + n)
+		size *= 2;
+	if ((v = reallocarray(t->v, size, sizeof(*v))) == NULL)
+		errx(1, "Couldn't allocate tokens");
+	t->v = v;
+	t->size = size;
+}
+
+static void
+push(struct yard *y, int operator)
+{
+	int *s;
+
+	if (y->depth == y->size) {
+		y->size = y->size ? y->size * 2 : 64;
+		if ((s = reallocarray(y->stack, y->size,
+		    sizeof(*s))) == NULL)
+			errx(1, "Couldn't allocate operator stack");
+		y->stack = s;
+	}
+	y->stack[y->depth++] = operator;
+}
+
+static void
+append(struct tokens *out, const struct token *t, int n)
+{
+	reserve(out, n);
+	for (int i = 0; i < n; i++)
+		out->v[out->n++] = t[i];
+}
+
+/*
+ * Move operator from top of the stack to RPN, see pop_to_queue
+ */
+static int
+pop_out(struct yard *y)
+{
+	struct token t[MAX_LOWERED];
+	int n;
+
+	if ((n = lower_operator(y->stack[--y->depth], t)) == -1)
+		return CALC_CONDITIONAL;
+	append(&y->out, t, n);
+	return CALC_OK;
+}
+
+/*
+ * Handle one token the way shunting_yard does. Empty stack looks like
+ * left bracket to it, but operator which reaches bottom of open stack
+ * is put off, returning PUT_OFF. Returns error code otherwise
+ */
+static int
+yard_step(struct yard *y, int type, long long int payload)
+{
+	struct token t[MAX_LOWERED];
+	int error, n;
+
+	switch (type) {
+	case TNUM:
+	case TVAR:
+		t[0].type = type;
+		t[0].payload = payload;
+		append(&y->out, t, 1);
+		return CALC_OK;
+	case TOPR:
+	case TQST:
+		while (y->depth > 0 &&
+		    pops_before(y->stack[y->depth - 1], payload))
+			if ((error = pop_out(y)) != CALC_OK)
+				return error;
+		if (y->depth == 0 && y->open)
+			return PUT_OFF;
+		push(y, payload);
+		n = branch_operator(payload, t);
+		append(&y->out, t, n);
+		return CALC_OK;
+	case TCOL:
+		while (y->depth > 0 && y->stack[y->depth - 1] != QST &&
+		    y->stack[y->depth - 1] != LBR)
+			if ((error = pop_out(y)) != CALC_OK)
+				return error;
+		if (y->depth == 0 && y->open)
+			return PUT_OFF;
+		if (y->depth == 0 || y->stack[y->depth - 1] != QST)
+			return CALC_CONDITIONAL;
+		y->stack[y->depth - 1] = COL;
+		t[0].type = TELSE;
+		t[0].payload = 0;
+		append(&y->out, t, 1);
+		return CALC_OK;
+	case TLBR:
+		push(y, LBR);
+		return CALC_OK;
+	case TRBR:
+		while (y->depth > 0 && y->stack[y->depth - 1] != LBR)
+			if ((error = pop_out(y)) != CALC_OK)
+				return error;
+		if (y->depth == 0)
+			return y->open ? PUT_OFF : CALC_BRACKET;
+		y->depth--;
+		return CALC_OK;
+	default:
+		return CALC_OK;
+	}
+}
+
+/*
+ * Turn words of chunk into tokens and run shunting yard over them,
+ * counting how bracket depth changes. Operators put off are kept in
+ * RPN of chunk with DEFERRED flag
+ */
+static void *
+parse_chunk(void *arg)
+{
+	struct chunk *c = arg;
+	struct token *t = NULL, deferred;
+	const char *p = c->start, *word;
+	char *buf = NULL;
+	size_t len, size = 0;
+	long depth = 0;
+	int n, error;
+
+	while (p < c->end && !c->failed) {
+		while (p < c->end && isspace((unsigned char)*p))
+			p++;
+		for (word = p; p < c->end && !isspace((unsigned char)*p); p++)
+			;
+		if ((len = p - word) == 0)
+			break;
+		/* Sequential parser stops at zero byte */
+		if (memchr(word, '\0', len) != NULL) {
+			c->failed = 1;
+			break;
+		}
+		/* Word needs terminating zero, file is mapped read only */
+		if (len + 1 > size) {
+			free(buf);
+			free(t);
+			size = len + 1 > 64 ? len + 1 : 64;
+			if ((buf = malloc(size)) == NULL ||
+			    (t = reallocarray(NULL, size, sizeof(*t))) == NULL)
+				errx(1, "Couldn't allocate word");
+		}
+		memcpy(buf, word, len);
+		buf[len] = '\0';
+		if (scan_word(buf, t, &n) != NULL) {
+			c->failed = 1;
+			break;
+		}
+		for (int i = 0; i < n && !c->failed; i++) {
+			if (t[i].type == TVAR) {
+				c->failed = 1; /* Symbol table isn't shared */
+				break;
+			}
+			if (t[i].type == TLBR)
+				depth++;
+			else if (t[i].type == TRBR && --depth < c->min_depth)
+				c->min_depth = depth;
+			error = yard_step(&c->yard, t[i].type, t[i].payload);
+			if (error == PUT_OFF) {
+				deferred.type = t[i].type | DEFERRED;
+				deferred.payload = t[i].payload;
+				append(&c->yard.out, &deferred, 1);
+			} else if (error != CALC_OK)
+				c->failed = 1;
+		}
+	}
+	c->depth_change = depth;
+	free(buf);
+	free(t);
+	return NULL;
+}
+
+/*
+ * Run f on every chunk, each on its own thread
+ */
+static void
+run_chunks(struct chunk *chunks, int n, void *(*f)(void *))
+{
+	for (int i = 0; i < n; i++)
+		if (pthread_create(&chunks[i].thread, NULL, f,
+		    &chunks[i]) != 0)
+			errx(1, "Couldn't create thread");
+	for (int i = 0; i < n; i++)
+		pthread_join(chunks[i].thread, NULL);
+}
+
+/*
+ * Compile tokens which operator stack of stitching has put out
+ */
+static void
+flush(struct compiler *cc, struct tokens *out)
+{
+	for (size_t i = 0; i < out->n; i++)
+		compile_token(cc, out->v[i].type, out->v[i].payload);
+	out->n = 0;
+}
+
+/*
+ * Join RPN of chunks on one operator stack, compiling it on the way.
+ * Returns 0 if expression should be parsed sequentially
+ */
+static int
+stitch(struct chunk *chunks, int n, struct program *prog)
+{
+	struct yard y = { 0 };
+	struct compiler cc;
+	struct token *t, *end;
+	int ok = 1;
+
+	cc_init(&cc, prog);
+	for (int i = 0; i < n && ok; i++) {
+		end = chunks[i].yard.out.v + chunks[i].yard.out.n;
+		for (t = chunks[i].yard.out.v; t < end && ok; t++) {
+			if (t->type & DEFERRED) {
+				ok = yard_step(&y, t->type & ~DEFERRED,
+				    t->payload) == CALC_OK;
+				flush(&cc, &y.out);
+			} else
+				compile_token(&cc, t->type, t->payload);
+		}
+		for (size_t j = 0; j < chunks[i].yard.depth; j++)
+			push(&y, chunks[i].yard.stack[j]);
+		free(chunks[i].yard.out.v);
+		chunks[i].yard.out.v = NULL;
+	}
+	while (ok && y.depth > 0) {
+		ok = pop_out(&y) == CALC_OK;
+		flush(&cc, &y.out);
+	}
+	cc_finish(&cc);
+
+	if (ok)
+		analyze_program(prog, NULL);
+	else
+		free_program(prog);
+	free(y.out.v);
+	free(y.stack);
+	return ok;
+}
+
+/*
+ * Parse len characters of s with jobs threads and compile them into
+ * prog. Returns error code
+ */
+int
+parse_parallel(const char *s, size_t len, int jobs, struct program *prog)
+{
+	struct chunk *chunks;
+	const char *p;
+	long depth = 0;
+	int n, ok = 1, error;
+
+	if ((n = len / CHUNK_MIN + 1) > jobs)
+		n = jobs;
+	if ((chunks = calloc(n, sizeof(*chunks))) == NULL)
+		errx(1, "Couldn't allocate chunks");
+	for (int i = 0; i < n; i++) {
+		p = s + len / n * i;
+		if (i > 0 && p < chunks[i - 1].start)
+			p = chunks[i - 1].start;
+		while (i > 0 && p < s + len && !isspace((unsigned char)*p))
+			p++;
+		chunks[i].start = p;
+		if (i > 0)
+			chunks[i - 1].end = p;
+		chunks[i].yard.open = i > 0;
+	}
+	chunks[n - 1].end = s + len;
+
+	run_chunks(chunks, n, parse_chunk);
+	for (int i = 0; i < n && ok; i++) {
+		ok = !chunks[i].failed && depth + chunks[i].min_depth >= 0;
+		depth += chunks[i].depth_change;
+	}
+	ok = ok && depth == 0 && stitch(chunks, n, prog);
+
+	for (int i = 0; i < n; i++) {
+		free(chunks[i].yard.out.v);
+		free(chunks[i].yard.stack);
+	}
+	free(chunks);
+	if (ok)
+		return CALC_OK;
+
+	if ((error = parse_expression(s, len)) != CALC_OK)
+		return error;
+	compile_rpn(prog);
+	return CALC_OK;
+}
+
+/*
+ * Parse and compile expression in file at path, "-" is standard input.
+ * With jobs > 0 it is parsed by that many threads
+ */
+void
+load_expression(const char *path, int jobs, struct program *prog)
+{
+	struct stat st;
+	char *s = NULL, *p;
+	size_t len = 0, size = 0;
+	ssize_t nr;
+	int fd, error, mapped = 0;
+
+	if (strcmp(path, "-") == 0)
+		fd = STDIN_FILENO;
+	else if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		err(1, "%s", path);
+	if (fstat(fd, &st) == -1)
+		err(1, "%s", path);
+	if (S_ISREG(st.st_mode) && st.st_size > 0) {
+		len = st.st_size;
+		if ((s = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd,
+		    0)) == MAP_FAILED)
+			err(1, "%s", path);
+		mapped = 1;
+	} else {
+		for (;;) {
+			if (len == size) {
+				size = size ? size * 2 : 64 * 1024;
+				if ((p = realloc(s, size)) == NULL)
+					errx(1, "Couldn't allocate expression");
+				s = p;
+			}
+			if ((nr = read(fd, s + len, size - len)) == -1)
+				err(1, "%s", path);
+			if (nr == 0)
+				break;
+			len += nr;
+		}
+	}
+	if (fd != STDIN_FILENO)
+		close(fd);
+
+	if (jobs > 0)
+		error = parse_parallel(s, len, jobs, prog);
+	else if ((error = parse_expression(s, len)) == CALC_OK)
+		compile_rpn(prog);
+	if (mapped)
+		munmap(s, len);
+	else
+		free(s);
+	if (error != CALC_OK)
+		errx(1, "%s", calc_strerror(error));
+}
+
+/*
+ * Evaluate expression in file at path, see load_expression
+ */
+int
+run_expression(const char *path, int jobs)
+{
+	struct program prog;
+	long long int *frame, result;
+	char buf[48];
+	int error;
+
+	load_expression(path, jobs, &prog);
+	if (prog.nvars > 0)
+		errx(1, "Unknown variable %s", symbol_name(prog.vars[0]));
+	frame = frame_alloc(&prog);
+	if ((error = run_program(&prog, frame, &result)) != CALC_OK)
+		errx(1, "%s", calc_strerror(error));
+	if (prog.result >= 0) {
+		if (prog.rational)
+			format_rational(buf, sizeof(buf), result,
+			    frame[prog.nframe + prog.result]);
+		else
+			format_value(buf, sizeof(buf), result, get_scale());
+		printf("%s \n", buf);
+	}
+	free(frame);
+	free_program(&prog);
+	return 0;
+}
@@ -0,0 +1,318 @@
+/*
+ * Copyright © 2022 — 2023 Artsiom Karakin <karakin2000@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Sweep mode: expression is evaluated for every value of one variable
+ * from range, and results are reduced to aggregates: number of values
+ * evaluated and failed, sum, minimum and maximum.
+ *
+ * Range is split into parts, one per thread. Parts are evaluated in
+ * blocks of BLOCK values by run_block. Sum is the same as adding
+ * results one by one in order of values with addition of the policy,
+ * though parts are summed independently, see add_result.
+ */
+#include "argcalc.h"
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum aggregate { AGG_COUNT, AGG_ERRORS, AGG_SUM, AGG_MIN, AGG_MAX,
+    AGG_NAMES };
+
+static const char *const aggregate_names[] = {
+	[AGG_COUNT] = "count",
+	[AGG_ERRORS] = "errors",
+	[AGG_SUM] = "sum",
+	[AGG_MIN] = "min",
+	[AGG_MAX] = "max",
+};
+
+struct sweep {
+	const struct program *prog;
+	int var; /* Frame slot of variable or -1 */
+	int blocks; /* Program has no jumps and runs in blocks */
+	long long int step;
+};
+
+struct part {
+	const struct sweep *sw;
+	unsigned long long first; /* First value of variable */
+	unsigned long long count; /* Number of values */
+	unsigned long long ok;
+	unsigned long long errors;
+	long long int min;
+	long long int max;
+	__int128 sum; /* See add_result */
+	__int128 lo;
+	__int128 hi;
+	pthread_t thread;
+};
+
+static __int128
+clamp(__int128 v, __int128 lo, __int128 hi)
+{
+	return v < lo ? lo : v > hi ? hi : v;
+}
+
+/*
+ * Add result to sum of part. Sum before the part isn't known yet, so
+ * what is kept depends on policy:
+ *	checked		exact sum and the lowest and the highest sum on
+ *			the way, which show if adding overflows anywhere
+ *	wrap		sum modulo 2^64
+ *	saturate	sum after the part is clamp(x + sum, lo, hi) of
+ *			sum x before it, as saturated additions compose
+ * Sum of 2^64 values of long long fits into 128 bits
+ */
+static void
+add_result(struct part *pt, int policy, long long int r)
+{
+	switch (policy) {
+	case POLICY_WRAP:
+		pt->sum = (unsigned long long)pt->sum + (unsigned long long)r;
+		break;
+	case POLICY_SATURATE:
+		pt->sum += r;
+		pt->lo = clamp(pt->lo + r, LLONG_MIN, LLONG_MAX);
+		pt->hi = clamp(pt->hi + r, LLONG_MIN, LLONG_MAX);
+		break;
+	default:
+		pt->sum += r;
+		if (pt->sum < pt->lo)
+			pt->lo = pt->sum;
+		if (pt->sum > pt->hi)
+			pt->hi = pt->sum;
+		break;
+	}
+}
+
+static void
+aggregate(struct part *pt, int policy, int error, long long int r)
+{
+	if (error != CALC_OK) {
+		pt->errors++;
+		return;
+	}
+	if (pt->ok++ == 0 || r < pt->min)
+		pt->min = r;
+	if (pt->ok == 1 || r > pt->max)
+		pt->max = r;
+	add_result(pt, policy, r);
+}
+
+/*
+ * Evaluate expression for values of part
+ */
+static void *
+sweep_part(void *arg)
+{
+	struct part *pt = arg;
+	const struct sweep *sw = pt->sw;
+	const struct program *p = sw->prog;
+	unsigned char errors[BLOCK];
+	unsigned long long done, v;
+	long long int *frame, *var, *res, r = 0;
+	int n, error;
+
+	frame = sw->blocks ? block_alloc(p) : frame_alloc(p);
+	var = sw->var < 0 ? NULL : frame + (size_t)sw->var *
+	    (sw->blocks ? BLOCK : 1);
+	res = sw->blocks ? frame + (size_t)p->result * BLOCK : NULL;
+	for (done = 0; done < pt->count; done += n) {
+		n = pt->count - done < BLOCK ? pt->count - done : BLOCK;
+		v = pt->first + done * sw->step;
+		if (!sw->blocks) {
+			for (int k = 0; k < n; k++, v += sw->step) {
+				if (var != NULL)
+					*var = v;
+				error = run_program(p, frame, &r);
+				aggregate(pt, p->policy, error, r);
+			}
+			continue;
+		}
+		if (var != NULL)
+			for (int k = 0; k < n; k++)
+				var[k] = v + k * sw->step;
+		memset(errors, 0, sizeof(errors));
+		run_block(p, frame, n, errors);
+		for (int k = 0; k < n; k++)
+			aggregate(pt, p->policy, errors[k], res[k]);
+	}
+	free(frame);
+	return NULL;
+}
+
+/*
+ * Parse comma separated names of aggregates into list ending with -1
+ */
+static void
+parse_aggregates(const char *spec, int *list)
+{
+	const char *p = spec;
+	size_t len;
+	int n = 0, i;
+
+	while (*p != '\0' && n < AGG_NAMES) {
+		len = strcspn(p, ",");
+		for (i = 0; i < AGG_NAMES; i++)
+			if (strlen(aggregate_names[i]) == len &&
+			    strncmp(p, aggregate_names[i], len) == 0)
+				break;
+		if (i == AGG_NAMES)
+			errx(1, "unknown aggregate \"%.*s\"", (int)len, p);
+		list[n++] = i;
+		p += len;
+		if (*p == ',')
+			p++;
+	}
+	list[n] = -1;
+}
+
+/*
+ * Evaluate expression in token list for every value of variable sym
+ * from lo to hi with jobs threads and print aggregates, all of them
+ * if aggregates is NULL. Values go in steps of one of current scale
+ */
+int
+run_sweep(int sym, long long int lo, long long int hi, int jobs,
+    const char *aggregates)
+{
+	struct program prog;
+	struct sweep sw;
+	struct part *parts;
+	unsigned long long count, per, ok = 0, errors = 0;
+	long long int min = 0, max = 0;
+	__int128 sum = 0;
+	int list[AGG_NAMES + 1], error, overflow = 0, status = 0;
+	char buf[32];
+
+	if (aggregates != NULL)
+		parse_aggregates(aggregates, list);
+	else {
+		for (int i = 0; i < AGG_NAMES; i++)
+			list[i] = i;
+		list[AGG_NAMES] = -1;
+	}
+
+	if ((error = shunting_yard()) != CALC_OK)
+		errx(1, "%s", calc_strerror(error));
+	compile_rpn(&prog);
+	for (int i = 0; i < prog.nvars; i++)
+		if (prog.vars[i] != sym)
+			errx(1, "Unknown variable %s",
+			    symbol_name(prog.vars[i]));
+
+	sw.prog = &prog;
+	sw.var = prog.nvars > 0 ? prog.nlits : -1;
+	sw.blocks = 1;
+	for (int i = 0; i < prog.ncode; i++)
+		if (prog.code[i].op == OP_JZ || prog.code[i].op == OP_JMP)
+			sw.blocks = 0;
+	parse_decimal("1", prog.scale, &sw.step);
+	count = ((unsigned long long)hi - lo) / sw.step + 1;
+	if (count == 0)
+		errx(1, "sweep range is too big");
+	if (prog.result < 0)
+		count = 0; /* Nothing to aggregate */
+
+	if (jobs < 1)
+		jobs = 1;
+	if ((unsigned long long)jobs > count)
+		jobs = count > 0 ? count : 1;
+	if ((parts = calloc(jobs, sizeof(*parts))) == NULL)
+		errx(1, "Couldn't allocate sweep");
+	per = count / jobs;
+	for (int i = 0; i < jobs; i++) {
+		parts[i].sw = &sw;
+		parts[i].count = per + ((unsigned long long)i < count % jobs);
+		parts[i].first = i == 0 ? (unsigned long long)lo :
+		    parts[i - 1].first + parts[i - 1].count * sw.step;
+		if (prog.policy == POLICY_SATURATE) {
+			parts[i].lo = LLONG_MIN;
+			parts[i].hi = LLONG_MAX;
+		}
+	}
+	for (int i = 1; i < jobs; i++)
+		if (pthread_create(&parts[i].thread, NULL, sweep_part,
+		    &parts[i]) != 0)
+			errx(1, "Couldn't create thread");
+	sweep_part(&parts[0]);
+	for (int i = 1; i < jobs; i++)
+		pthread_join(parts[i].thread, NULL);
+
+	/* Join parts in order of values */
+	for (int i = 0; i < jobs; i++) {
+		if (parts[i].ok > 0) {
+			if (ok == 0 || parts[i].min < min)
+				min = parts[i].min;
+			if (ok == 0 || parts[i].max > max)
+				max = parts[i].max;
+		}
+		ok += parts[i].ok;
+		errors += parts[i].errors;
+		switch (prog.policy) {
+		case POLICY_WRAP:
+			sum = (unsigned long long)sum +
+			    (unsigned long long)parts[i].sum;
+			break;
+		case POLICY_SATURATE:
+			sum = clamp(sum + parts[i].sum, parts[i].lo,
+			    parts[i].hi);
+			break;
+		default:
+			if (sum + parts[i].lo < LLONG_MIN ||
+			    sum + parts[i].hi > LLONG_MAX)
+				overflow = 1;
+			sum += parts[i].sum;
+			break;
+		}
+	}
+
+	for (int *a = list; *a != -1; a++) {
+		switch (*a) {
+		case AGG_COUNT:
+			printf("count %llu\n", ok);
+			continue;
+		case AGG_ERRORS:
+			printf("errors %llu\n", errors);
+			continue;
+		case AGG_SUM:
+			if (overflow) {
+				warnx("sum: %s", calc_strerror(CALC_OVERFLOW));
+				status = 1;
+				continue;
+			}
+			format_value(buf, sizeof(buf), (long long int)sum,
+			    prog.scale);
+			break;
+		case AGG_MIN:
+		case AGG_MAX:
+			if (ok == 0)
+				continue;
+			format_value(buf, sizeof(buf), *a == AGG_MIN ? min :
+			    max, prog.scale);
+			break;
+		}
+		printf("%s %s\n", aggregate_names[*a], buf);
+	}
+
+	free(parts);
+	free_program(&prog);
+	return status;
+}
@@ -0,0 +1,1318 @@
+/*
+ * Copyright © 2022 — 2023 Artsiom Karakin <karakin2000@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "argcalc.h"
+
+#include <ctype.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * While compiling operands are tagged with area of the frame they
+ * point to, because sizes of areas are known only at the end
+ */
+#define OPND_LIT	(0 << 29)
+#define OPND_VAR	(1 << 29)
+#define OPND_REG	(2 << 29)
+#define OPND_MASK	(3 << 29)
+
+/* Policy and scale of programs compiled from now on */
+static int default_policy = POLICY_CHECKED;
+static int default_scale;
+static struct modulus default_mod;
+static int default_rational;
+
+static const long long int powers10[MAX_SCALE + 1] = {
+	1LL, 10LL, 100LL, 1000LL, 10000LL, 100000LL, 1000000LL,
+	10000000LL, 100000000LL, 1000000000LL, 10000000000LL,
+	100000000000LL, 1000000000000LL, 10000000000000LL,
+	100000000000000LL, 1000000000000000LL, 10000000000000000LL,
+	100000000000000000LL, 1000000000000000000LL
+};
+
+/*
+ * Return message for error code returned by kernels and evaluator
+ */
+const char *
+calc_strerror(int error)
+{
+	switch (error) {
+	case CALC_OVERFLOW:
+		return "Integer overflow";
+	case CALC_DIVZERO:
+		return "Division by zero";
+	case CALC_STACK:
+		return "Inconsistent number of operators";
+	case CALC_RANGE:
+		return "Number is out of range";
+	case CALC_BRACKET:
+		return "Unbalanced brackets";
+	case CALC_UNKNOWN:
+		return "Unknown variable";
+	case CALC_CYCLE:
+		return "Circular dependency";
+	case CALC_DEPENDENCY:
+		return "Depends on failed cell";
+	case CALC_REDEFINED:
+		return "Cell is defined twice";
+	case CALC_DECLARED:
+		return "Value is out of declared range";
+	case CALC_CONDITIONAL:
+		return "Unbalanced ? and :";
+	default:
+		return "No error";
+	}
+}
+
+/*
+ * substract operand_second from operand_first
+ * This should report error if overflow occurs
+ */
+int
+substract(long long int op_first, long long int op_second,
+    long long int *res)
+{
+	if ((op_second > 0 && op_first < LONG_MIN + op_second) ||
+	    (op_second < 0 && op_first > LONG_MAX + op_second)) {
+		return CALC_OVERFLOW;
+	} else {
+		*res = op_first - op_second;
+	}
+	return CALC_OK;
+}
+
+/*
+ * Addup operand_second to operand_first
+ * This should report error if overflow occurs
+ * and it is reporting it
+ */
+int
+addup(long long int op_first, long long int op_second, long long int *res)
+{
+	if (((op_second > 0) && (op_first > (LONG_MAX - op_second))) ||
+	    ((op_second < 0) && (op_first < (LONG_MIN - op_second)))) {
+		return CALC_OVERFLOW;
+	} else {
+		*res = op_first + op_second;
+	}
+	return CALC_OK;
+}
+
+/*
+ * Multiply two numbers: op_first and op_second and
+ * handle all possible overflow errors
+ */
+int
+multiply(long long int op_first, long long int op_second,
+    long long int *res)
+{
+	if (op_first > 0) { /* op_first is positive */
+		if (op_second > 0) { /* op_first and op_second is positive */
+			if (op_first > (LONG_MAX / op_second)) {
+				return CALC_OVERFLOW;
+			} else { /* op_first is positive op_second is not */
+				if (op_second < (LONG_MIN / op_first)) {
+					return CALC_OVERFLOW;
+				}
+			}
+		} /* op_first is positive, op_second nonpositive */
+	} else { /* op_first is nonpositive */
+		if (op_second > 0) { /* op_first is nonpositive, op_second is positive */
+			if (op_first < (LONG_MIN / op_second)) {
+				return CALC_OVERFLOW;
+			}
+		} else { /* op_first and op_second is nonpositive */
+			if ((op_first != 0) &&
+			    (op_second < (LONG_MAX / op_first))) {
+				return CALC_OVERFLOW;
+			}
+		} /* End if op_first and op_second are nonpositive */
+	} /* End if op_first is nonpositive */
+
+	*res = op_first * op_second;
+	return CALC_OK;
+}
+
+/*
+ * Devide op_first by op_second and handle if present
+ */
+int
+devide(long long int op_first, long long int op_second, long long int *res)
+{
+	if (op_second == 0)
+		return CALC_DIVZERO;
+
+	if ((op_first == LONG_MIN) && (op_second == -1))
+		return CALC_OVERFLOW;
+
+	*res = op_first / op_second;
+	return CALC_OK;
+}
+
+/*
+ * Find magic number for division by d, see Hacker's Delight 10-1.
+ * Returns 0 for divisors which must go to devide: zero and -1 fail
+ * there, 1 and -1 don't have magic number
+ */
+int
+divisor_init(struct divisor *dv, long long int d)
+{
+	const unsigned long long two63 = 1ULL << 63;
+	unsigned long long ad, t, anc, q1, r1, q2, r2, delta;
+	int p = 63;
+
+	if (d >= -1 && d <= 1)
+		return 0;
+	ad = d < 0 ? -(unsigned long long)d : (unsigned long long)d;
+	t = two63 + ((unsigned long long)d >> 63);
+	anc = t - 1 - t % ad;
+	q1 = two63 / anc;
+	r1 = two63 - q1 * anc;
+	q2 = two63 / ad;
+	r2 = two63 - q2 * ad;
+	do {
+		p++;
+		q1 *= 2;
+		r1 *= 2;
+		if (r1 >= anc) {
+			q1++;
+			r1 -= anc;
+		}
+		q2 *= 2;
+		r2 *= 2;
+		if (r2 >= ad) {
+			q2++;
+			r2 -= ad;
+		}
+		delta = ad - r2;
+	} while (q1 < delta || (q1 == delta && r1 == 0));
+
+	dv->magic = (long long int)(q2 + 1);
+	if (d < 0)
+		dv->magic = -(unsigned long long)dv->magic;
+	dv->aux = p - 64;
+	if (d > 0 && dv->magic < 0)
+		dv->aux |= DIV_ADD;
+	else if (d < 0 && dv->magic > 0)
+		dv->aux |= DIV_SUB;
+	return 1;
+}
+
+/*
+ * Divide n by divisor with magic number and aux from divisor_init,
+ * truncating like devide does
+ */
+long long int
+divide_magic(long long int n, long long int magic, unsigned char aux)
+{
+	long long int q;
+
+	q = ((__int128)magic * n) >> 64;
+	if (aux & DIV_ADD)
+		q = (unsigned long long)q + n;
+	else if (aux & DIV_SUB)
+		q = (unsigned long long)q - n;
+	q >>= aux & DIV_SHIFT;
+	return q + ((unsigned long long)q >> 63);
+}
+
+/*
+ * Barrett reduction of t < 2^(2 * bits): t mod n. Quotient estimate is
+ * at most two less than t / n
+ */
+static inline unsigned long long
+barrett(const struct modulus *m, unsigned __int128 t)
+{
+	unsigned __int128 q, r;
+
+	q = ((t >> (m->bits - 1)) * m->mu) >> (m->bits + 1);
+	r = t - q * m->n;
+	while (r >= m->n)
+		r -= m->n;
+	return r;
+}
+
+/*
+ * Montgomery reduction of t < n * 2^64: t / 2^64 mod n. Residues of
+ * even n have no 2^64 in them, so it is t mod n for them
+ */
+static inline unsigned long long
+redc(const struct modulus *m, unsigned __int128 t)
+{
+	unsigned long long q = (unsigned long long)t * m->ninv, r;
+
+	if (m->n % 2 == 0)
+		return barrett(m, t);
+	r = (t + (unsigned __int128)q * m->n) >> 64;
+	return r >= m->n ? r - m->n : r;
+}
+
+static inline long long int
+mont_mul(const struct modulus *m, unsigned long long a, unsigned long long b)
+{
+	return redc(m, (unsigned __int128)a * b);
+}
+
+/* Residues are below 2^63, so their sum fits */
+static inline long long int
+mod_add(const struct modulus *m, unsigned long long a, unsigned long long b)
+{
+	a += b;
+	return a >= m->n ? a - m->n : a;
+}
+
+static inline long long int
+mod_sub(const struct modulus *m, unsigned long long a, unsigned long long b)
+{
+	return a >= b ? a - b : a + m->n - b;
+}
+
+/*
+ * Inverse of x modulo n by extended Euclid, 0 if there is none
+ */
+static unsigned long long
+mod_inverse(unsigned long long x, unsigned long long n)
+{
+	long long int s = 0, s1 = 1, t;
+	unsigned long long r = n, r1 = x, q, u;
+
+	while (r1 != 0) {
+		q = r / r1;
+		u = r - q * r1;
+		r = r1;
+		r1 = u;
+		t = s - (long long int)q * s1;
+		s = s1;
+		s1 = t;
+	}
+	if (r != 1)
+		return 0;
+	return s < 0 ? (unsigned long long)s + n : (unsigned long long)s;
+}
+
+/*
+ * Divide a by b multiplying by inverse of b. Fails when b has no
+ * inverse: it is zero or shares factor with modulus
+ */
+static int
+mod_div(const struct modulus *m, unsigned long long a, unsigned long long b,
+    long long int *res)
+{
+	unsigned long long inv;
+
+	/* b is b' * 2^64, a * 1/b' is a / b * 2^64 */
+	if ((inv = mod_inverse(redc(m, b), m->n)) == 0)
+		return CALC_DIVZERO;
+	*res = mont_mul(m, a, mont_mul(m, inv, m->r2));
+	return CALC_OK;
+}
+
+/*
+ * Constants of reduction modulo n, see struct modulus, or none for 0
+ */
+void
+init_modulus(struct modulus *m, unsigned long long n)
+{
+	unsigned long long inv = n;
+
+	memset(m, 0, sizeof(*m));
+	if (n == 0)
+		return;
+	m->n = n;
+	if (n % 2 == 0) {
+		m->bits = 64 - __builtin_clzll(n);
+		m->mu = ((unsigned __int128)1 << 2 * m->bits) / n;
+		m->r2 = 1;
+		return;
+	}
+	/* Newton's iteration doubles number of correct low bits */
+	for (int i = 0; i < 5; i++)
+		inv *= 2 - n * inv;
+	m->ninv = -inv;
+	m->r2 = ((unsigned __int128)1 << 64) % n;
+	m->r2 = (unsigned __int128)m->r2 * m->r2 % n;
+}
+
+/*
+ * Residue of num modulo m in Montgomery form
+ */
+long long int
+to_residue(const struct modulus *m, long long int num)
+{
+	if ((num %= (long long int)m->n) < 0)
+		num += m->n;
+	return mont_mul(m, num, m->r2);
+}
+
+/*
+ * Greatest common divisor by binary algorithm of Stein: common powers
+ * of two are shifted out at once, then the smaller odd number is
+ * subtracted from the bigger one. gcd(0, v) is v
+ */
+static inline unsigned long long
+gcd(unsigned long long u, unsigned long long v)
+{
+	unsigned long long t;
+	int shift;
+
+	if (u == 0 || v == 0)
+		return u | v;
+	shift = __builtin_ctzll(u | v);
+	u >>= __builtin_ctzll(u);
+	do {
+		v >>= __builtin_ctzll(v);
+		if (u > v) {
+			t = u;
+			u = v;
+			v = t;
+		}
+		v -= u;
+	} while (v != 0);
+	return u << shift;
+}
+
+static inline unsigned long long
+magnitude(long long int a)
+{
+	return a < 0 ? -(unsigned long long)a : (unsigned long long)a;
+}
+
+/* Divide a by its divisor g, which may be 2^63 */
+static inline long long int
+div_exact(long long int a, unsigned long long g)
+{
+	unsigned long long q = magnitude(a) / g;
+
+	return a < 0 ? (long long int)-q : (long long int)q;
+}
+
+/*
+ * Store reduced fraction n/d with d > 0, fails like multiply() if
+ * numerator or denominator doesn't fit
+ */
+static inline int
+fit_rational(__int128 n, __int128 d, long long int *num, long long int *den)
+{
+	if (n < LLONG_MIN || n > LLONG_MAX || d > LLONG_MAX)
+		return CALC_OVERFLOW;
+	*num = n;
+	*den = d;
+	return CALC_OK;
+}
+
+/*
+ * a/b + c/d, or a/b - c/d if sub is set, with fractions in lowest terms
+ * and positive denominators. Only common factor of numerator of sum
+ * and the new denominator can be in g = gcd(b, d), so the sum is
+ * reduced by gcd of it and g
+ */
+static int
+rational_add(long long int a, long long int b, long long int c,
+    long long int d, int sub, long long int *num, long long int *den)
+{
+	unsigned long long g = gcd(b, d), g2;
+	__int128 t, u;
+
+	t = (__int128)a * (d / (long long int)g);
+	u = (__int128)c * (b / (long long int)g);
+	t = sub ? t - u : t + u;
+	g2 = gcd(magnitude(t % (long long int)g), g);
+	return fit_rational(t / (long long int)g2,
+	    (__int128)(b / (long long int)g) * (d / (long long int)g2),
+	    num, den);
+}
+
+/*
+ * a/b * c/d, numerator of one fraction can only share factors with
+ * denominator of the other one
+ */
+static int
+rational_mul(long long int a, long long int b, long long int c,
+    long long int d, long long int *num, long long int *den)
+{
+	unsigned long long g1 = gcd(magnitude(a), d), g2 = gcd(magnitude(c), b);
+
+	return fit_rational((__int128)div_exact(a, g1) * div_exact(c, g2),
+	    (__int128)(b / (long long int)g2) * (d / (long long int)g1),
+	    num, den);
+}
+
+/*
+ * a/b / c/d is a*d / b*c, sign of c goes to numerator
+ */
+static int
+rational_div(long long int a, long long int b, long long int c,
+    long long int d, long long int *num, long long int *den)
+{
+	unsigned long long g1 = gcd(magnitude(a), magnitude(c)), g2 = gcd(b, d);
+	__int128 n, m;
+
+	if (c == 0)
+		return CALC_DIVZERO;
+	n = (__int128)div_exact(a, g1) * (d / (long long int)g2);
+	m = (__int128)(b / (long long int)g2) * div_exact(c, g1);
+	return m < 0 ? fit_rational(-n, -m, num, den) :
+	    fit_rational(n, m, num, den);
+}
+
+/*
+ * Execute operation on rationals, numerators are in frame and their
+ * denominators are nframe elements further. Overflow of numerator or
+ * denominator is an error under every policy
+ */
+int
+rational_op(const struct program *p, const struct insn *ip,
+    long long int *frame)
+{
+	long long int *den = frame + p->nframe;
+	long long int a = frame[ip->a], b = den[ip->a];
+	long long int c = frame[ip->b], d = den[ip->b];
+	__int128 l, r;
+
+	switch (ip->op) {
+	case OP_QADD:
+	case OP_QSUB:
+		return rational_add(a, b, c, d, ip->op == OP_QSUB,
+		    &frame[ip->dst], &den[ip->dst]);
+	case OP_QMUL:
+		return rational_mul(a, b, c, d, &frame[ip->dst], &den[ip->dst]);
+	case OP_QDIV:
+		return rational_div(a, b, c, d, &frame[ip->dst], &den[ip->dst]);
+	case OP_QMOV:
+		frame[ip->dst] = a;
+		den[ip->dst] = b;
+		return CALC_OK;
+	}
+
+	/* Comparison, denominators are positive */
+	l = (__int128)a * d;
+	r = (__int128)c * b;
+	switch (ip->op) {
+	case OP_LT:
+		frame[ip->dst] = l < r;
+		break;
+	case OP_GT:
+		frame[ip->dst] = l > r;
+		break;
+	case OP_LE:
+		frame[ip->dst] = l <= r;
+		break;
+	case OP_GE:
+		frame[ip->dst] = l >= r;
+		break;
+	case OP_EQ:
+		frame[ip->dst] = l == r;
+		break;
+	default:
+		frame[ip->dst] = l != r;
+		break;
+	}
+	den[ip->dst] = 1;
+	return CALC_OK;
+}
+
+/*
+ * Grow array pointed by *p holding *size elements of elsize bytes,
+ * so it can hold at least need elements
+ */
+static void
+grow(void *p, int *size, int need, size_t elsize)
+{
+	void *n;
+	int new_size;
+
+	if (need <= *size)
+		return;
+	new_size = *size ? *size : 16;
+	while (new_size < need)
+		new_size *= 2;
+	if ((n = reallocarray(*(void **)p, new_size, elsize)) == NULL)
+		errx(1, "Couldn't grow compiled expression");
+	*(void **)p = n;
+	*size = new_size;
+}
+
+static void
+emit(struct compiler *cc, int op, int dst, int a, int b)
+{
+	struct program *p = cc->prog;
+	struct insn *ip;
+
+	grow(&p->code, &cc->code_size, p->ncode + 1, sizeof(*p->code));
+	ip = &p->code[p->ncode++];
+	ip->op = op;
+	ip->aux = 0;
+	ip->dst = dst;
+	ip->a = a;
+	ip->b = b;
+}
+
+static void
+push_operand(struct compiler *cc, int opnd)
+{
+	grow(&cc->stack, &cc->stack_size, cc->depth + 1, sizeof(*cc->stack));
+	cc->stack[cc->depth++] = opnd;
+	if (cc->depth > cc->prog->nregs)
+		cc->prog->nregs = cc->depth;
+}
+
+/*
+ * Prepare compiler to translate RPN into program p
+ */
+void
+cc_init(struct compiler *cc, struct program *p)
+{
+	memset(p, 0, sizeof(*p));
+	memset(cc, 0, sizeof(*cc));
+	cc->prog = p;
+	p->result = -1;
+	p->policy = default_policy;
+	p->scale = default_scale;
+	p->mod = default_mod;
+	p->rational = default_rational;
+}
+
+/*
+ * Number from RPN doesn't produce any instruction, it goes to literal
+ * pool and will be used directly as operand by following operator
+ */
+void
+cc_num(struct compiler *cc, long long int num)
+{
+	struct program *p = cc->prog;
+
+	if (cc->dead)
+		return;
+	if (p->mod.n != 0)
+		num = to_residue(&p->mod, num);
+	grow(&p->lits, &cc->lits_size, p->nlits + 1, sizeof(*p->lits));
+	p->lits[p->nlits] = num;
+	push_operand(cc, OPND_LIT | p->nlits++);
+}
+
+/*
+ * Variable goes to variable table of the program once, no matter how
+ * many times it is used. Its value is put into frame by frame_bind
+ */
+void
+cc_var(struct compiler *cc, int sym)
+{
+	struct program *p = cc->prog;
+	int i;
+
+	if (cc->dead)
+		return;
+	for (i = 0; i < p->nvars; i++)
+		if (p->vars[i] == sym)
+			break;
+	if (i == p->nvars) {
+		grow(&p->vars, &cc->vars_size, p->nvars + 1, sizeof(*p->vars));
+		p->vars[p->nvars++] = sym;
+	}
+	push_operand(cc, OPND_VAR | i);
+}
+
+/*
+ * Division by literal becomes multiplication by magic number, which
+ * takes place of the divisor in literal pool. Every literal is used
+ * by one instruction only, so nothing else sees it
+ */
+static int
+cc_divisor(struct compiler *cc, int dst, int a, int b)
+{
+	struct program *p = cc->prog;
+	struct divisor dv;
+
+	if ((b & OPND_MASK) != OPND_LIT ||
+	    !divisor_init(&dv, p->lits[b & ~OPND_MASK]))
+		return 0;
+	p->lits[b & ~OPND_MASK] = dv.magic;
+	emit(cc, OP_MDIV, dst, a, b);
+	p->code[p->ncode - 1].aux = dv.aux;
+	return 1;
+}
+
+/*
+ * Operands are missing: program fails at this point like stack
+ * evaluator did. Jumps of open conditionals lead here too, so failure
+ * doesn't depend on branch taken
+ */
+static void
+cc_trap(struct compiler *cc)
+{
+	struct program *p = cc->prog;
+
+	emit(cc, OP_TRAP, 0, 0, 0);
+	p->code[p->ncode - 1].aux = CALC_STACK;
+	for (int i = 0; i < cc->nbranches; i += 2)
+		p->code[cc->branches[i]].dst = p->ncode - 1;
+	cc->dead = 1;
+	cc->depth = 0;
+}
+
+/*
+ * Operator from RPN takes two topmost operands and leave result in
+ * register numbered as stack slot of the first operand. If there
+ * aren't enough operands program will fail at this point like stack
+ * evaluator did
+ */
+void
+cc_op(struct compiler *cc, int op)
+{
+	int a, b, dst;
+
+	if (cc->dead)
+		return;
+	if (cc->depth < 2) {
+		cc_trap(cc);
+		return;
+	}
+	b = cc->stack[--cc->depth];
+	a = cc->stack[--cc->depth];
+	dst = OPND_REG | cc->depth;
+	if (op != OP_DIV || !cc_divisor(cc, dst, a, b))
+		emit(cc, op, dst, a, b);
+	if (op == OP_DMUL || op == OP_DDIV)
+		cc->prog->code[cc->prog->ncode - 1].aux = cc->prog->scale;
+	else if (op >= OP_LT && op <= OP_NE)
+		cc->prog->code[cc->prog->ncode - 1].aux = cc->prog->rational ?
+		    CMP_RATIONAL : cc->prog->mod.n != 0 ? CMP_RESIDUE : 0;
+	push_operand(cc, dst);
+}
+
+/*
+ * Unmatched left bracket left on operator stack takes two operands
+ * and gives nothing, as evaluator of RPN always did
+ */
+void
+cc_drop(struct compiler *cc)
+{
+	if (cc->dead)
+		return;
+	if (cc->depth < 2) {
+		cc_trap(cc);
+		return;
+	}
+	cc->depth -= 2;
+}
+
+/*
+ * Put value of topmost operand into register of depth d, where both
+ * branches of conditional leave their values, and drop the rest
+ */
+static void
+cc_join(struct compiler *cc, int d)
+{
+	int value = cc->stack[cc->depth - 1];
+
+	if (value != (OPND_REG | d))
+		emit(cc, cc->prog->rational ? OP_QMOV : OP_MOV, OPND_REG | d,
+		    value, 0);
+	cc->depth = d;
+}
+
+/*
+ * Value on top of the stack chooses branch of conditional. It is
+ * jumped over if value is zero
+ */
+void
+cc_if(struct compiler *cc)
+{
+	if (cc->dead)
+		return;
+	if (cc->depth < 1) {
+		cc_trap(cc);
+		return;
+	}
+	emit(cc, OP_JZ, 0, cc->stack[--cc->depth], 0);
+	grow(&cc->branches, &cc->branches_size, cc->nbranches + 2,
+	    sizeof(*cc->branches));
+	cc->branches[cc->nbranches++] = cc->prog->ncode - 1;
+	cc->branches[cc->nbranches++] = cc->depth;
+}
+
+/*
+ * End of the first branch jumps over the second one, which begins
+ * where OP_JZ jumps to
+ */
+void
+cc_else(struct compiler *cc)
+{
+	struct program *p = cc->prog;
+	int *br;
+
+	if (cc->dead)
+		return;
+	br = &cc->branches[cc->nbranches - 2];
+	if (cc->depth < br[1] + 1) {
+		cc_trap(cc);
+		return;
+	}
+	cc_join(cc, br[1]);
+	emit(cc, OP_JMP, 0, 0, 0);
+	p->code[br[0]].dst = p->ncode;
+	br[0] = p->ncode - 1;
+}
+
+void
+cc_endif(struct compiler *cc)
+{
+	struct program *p = cc->prog;
+	int *br;
+
+	if (cc->dead)
+		return;
+	br = &cc->branches[cc->nbranches - 2];
+	if (cc->depth < br[1] + 1) {
+		cc_trap(cc);
+		return;
+	}
+	cc_join(cc, br[1]);
+	p->code[br[0]].dst = p->ncode;
+	cc->nbranches -= 2;
+	push_operand(cc, OPND_REG | cc->depth);
+}
+
+/*
+ * Convert tagged operand into frame index
+ */
+static int
+relocate(const struct program *p, int opnd)
+{
+	switch (opnd & OPND_MASK) {
+	case OPND_VAR:
+		return p->nlits + (opnd & ~OPND_MASK);
+	case OPND_REG:
+		return p->nlits + p->nvars + (opnd & ~OPND_MASK);
+	default:
+		return opnd & ~OPND_MASK;
+	}
+}
+
+/*
+ * Finish compilation: top of the stack becomes result, all operands
+ * are converted to frame indexes
+ */
+void
+cc_finish(struct compiler *cc)
+{
+	struct program *p = cc->prog;
+	struct insn *ip;
+
+	p->nframe = p->nlits + p->nvars + p->nregs;
+	for (ip = p->code; ip < p->code + p->ncode; ip++) {
+		switch (ip->op) {
+		case OP_TRAP:
+		case OP_JMP:
+			continue;
+		case OP_JZ:
+			/* Destination is index of instruction */
+			ip->a = relocate(p, ip->a);
+			continue;
+		}
+		ip->dst = relocate(p, ip->dst);
+		ip->a = relocate(p, ip->a);
+		ip->b = relocate(p, ip->b);
+	}
+	if (cc->depth > 0)
+		p->result = relocate(p, cc->stack[cc->depth - 1]);
+	free(cc->stack);
+	cc->stack = NULL;
+	free(cc->branches);
+	cc->branches = NULL;
+}
+
+/*
+ * Allocate frame for program and fill it with literals. Frame may be
+ * reused for as many runs of the program as needed
+ */
+long long int *
+frame_alloc(const struct program *p)
+{
+	long long int *frame;
+	size_t n = p->nframe ? p->nframe : 1;
+
+	if ((frame = calloc(p->rational ? 2 * n : n, sizeof(*frame))) == NULL)
+		errx(1, "Couldn't allocate frame");
+	frame_init(p, frame);
+	return frame;
+}
+
+/*
+ * Fill frame of at least p->nframe elements with literals of program.
+ * Frame of rationals is twice as big, denominators of integers are 1
+ */
+void
+frame_init(const struct program *p, long long int *frame)
+{
+	if (p->nlits > 0)
+		memcpy(frame, p->lits, p->nlits * sizeof(*frame));
+	for (int i = 0; p->rational && i < p->nframe; i++)
+		frame[p->nframe + i] = 1;
+}
+
+/*
+ * Put values of variables into frame, values are indexed by symbol
+ */
+void
+frame_bind(const struct program *p, long long int *frame,
+    const long long int *values)
+{
+	for (int i = 0; i < p->nvars; i++)
+		frame[p->nlits + i] = values[p->vars[i]];
+}
+
+/*
+ * Two's complement wrapping kernels. Division by zero still fails,
+ * LONG_MIN / -1 wraps to LONG_MIN
+ */
+static inline int
+wrap_add(long long int a, long long int b, long long int *res)
+{
+	*res = (unsigned long long)a + (unsigned long long)b;
+	return CALC_OK;
+}
+
+static inline int
+wrap_sub(long long int a, long long int b, long long int *res)
+{
+	*res = (unsigned long long)a - (unsigned long long)b;
+	return CALC_OK;
+}
+
+static inline int
+wrap_mul(long long int a, long long int b, long long int *res)
+{
+	*res = (unsigned long long)a * (unsigned long long)b;
+	return CALC_OK;
+}
+
+static inline int
+wrap_div(long long int a, long long int b, long long int *res)
+{
+	if (b == 0)
+		return CALC_DIVZERO;
+	*res = b == -1 ? (long long int)-(unsigned long long)a : a / b;
+	return CALC_OK;
+}
+
+/*
+ * Saturating kernels, results which don't fit are clamped to
+ * LONG_MIN or LONG_MAX. Division by zero still fails
+ */
+static inline int
+sat_add(long long int a, long long int b, long long int *res)
+{
+	if (__builtin_add_overflow(a, b, res))
+		*res = b < 0 ? LLONG_MIN : LLONG_MAX;
+	return CALC_OK;
+}
+
+static inline int
+sat_sub(long long int a, long long int b, long long int *res)
+{
+	if (__builtin_sub_overflow(a, b, res))
+		*res = b > 0 ? LLONG_MIN : LLONG_MAX;
+	return CALC_OK;
+}
+
+static inline int
+sat_mul(long long int a, long long int b, long long int *res)
+{
+	if (__builtin_mul_overflow(a, b, res))
+		*res = (a < 0) != (b < 0) ? LLONG_MIN : LLONG_MAX;
+	return CALC_OK;
+}
+
+static inline int
+sat_div(long long int a, long long int b, long long int *res)
+{
+	if (b == 0)
+		return CALC_DIVZERO;
+	*res = a == LLONG_MIN && b == -1 ? LLONG_MAX : a / b;
+	return CALC_OK;
+}
+
+/*
+ * Decimal operations on values scaled by 10^scale. Exact result is
+ * computed in 128 bits and rounded half away from zero, then policy
+ * decides what to do if it doesn't fit
+ */
+static inline __int128
+dec_mul(long long int a, long long int b, int scale)
+{
+	__int128 p = (__int128)a * b, q, r;
+	long long int d = powers10[scale];
+
+	q = p / d;
+	r = p % d;
+	if (2 * (r < 0 ? -r : r) >= d)
+		q += p < 0 ? -1 : 1;
+	return q;
+}
+
+static inline __int128
+dec_div(long long int a, long long int b, int scale)
+{
+	__int128 n = (__int128)a * powers10[scale], q, r, d = b;
+
+	q = n / d;
+	r = n % d;
+	if (2 * (r < 0 ? -r : r) >= (d < 0 ? -d : d))
+		q += (n < 0) != (d < 0) ? -1 : 1;
+	return q;
+}
+
+static inline int
+fit_checked(__int128 v, long long int *res)
+{
+	if (v < LLONG_MIN || v > LLONG_MAX)
+		return CALC_OVERFLOW;
+	*res = v;
+	return CALC_OK;
+}
+
+static inline int
+fit_wrap(__int128 v, long long int *res)
+{
+	*res = (unsigned long long)v;
+	return CALC_OK;
+}
+
+static inline int
+fit_saturate(__int128 v, long long int *res)
+{
+	*res = v < LLONG_MIN ? LLONG_MIN : v > LLONG_MAX ? LLONG_MAX : v;
+	return CALC_OK;
+}
+
+/*
+ * Compare values, residues are compared by their values, not by
+ * Montgomery form
+ */
+static inline long long int
+compare(const struct program *p, const struct insn *ip, long long int a,
+    long long int b)
+{
+	if (ip->aux == CMP_RESIDUE) {
+		a = redc(&p->mod, (unsigned long long)a);
+		b = redc(&p->mod, (unsigned long long)b);
+	}
+	switch (ip->op) {
+	case OP_LT:
+		return a < b;
+	case OP_GT:
+		return a > b;
+	case OP_LE:
+		return a <= b;
+	case OP_GE:
+		return a >= b;
+	case OP_EQ:
+		return a == b;
+	default:
+		return a != b;
+	}
+}
+
+#define POLICY(name)	name##_checked
+#define POLICY_FIT	fit_checked
+#define POLICY_ADD	addup
+#define POLICY_SUB	substract
+#define POLICY_MUL	multiply
+#define POLICY_DIV	devide
+#include "vmloop.h"
+
+#define POLICY(name)	name##_wrap
+#define POLICY_FIT	fit_wrap
+#define POLICY_ADD	wrap_add
+#define POLICY_SUB	wrap_sub
+#define POLICY_MUL	wrap_mul
+#define POLICY_DIV	wrap_div
+#include "vmloop.h"
+
+#define POLICY(name)	name##_saturate
+#define POLICY_FIT	fit_saturate
+#define POLICY_ADD	sat_add
+#define POLICY_SUB	sat_sub
+#define POLICY_MUL	sat_mul
+#define POLICY_DIV	sat_div
+#include "vmloop.h"
+
+static int (*const runners[])(const struct program *, long long int *,
+    long long int *) = {
+	[POLICY_CHECKED] = run_checked,
+	[POLICY_WRAP] = run_wrap,
+	[POLICY_SATURATE] = run_saturate,
+};
+
+static const char *const policy_names[] = {
+	[POLICY_CHECKED] = "checked",
+	[POLICY_WRAP] = "wrap",
+	[POLICY_SATURATE] = "saturate",
+};
+
+/*
+ * Find policy by name. Returns -1 if there is no such policy
+ */
+int
+policy_from_name(const char *name)
+{
+	for (int i = 0; i < POLICY_COUNT; i++)
+		if (strcmp(name, policy_names[i]) == 0)
+			return i;
+	return -1;
+}
+
+/*
+ * Set policy of programs compiled from now on
+ */
+void
+set_policy(int policy)
+{
+	default_policy = policy;
+}
+
+int
+get_policy(void)
+{
+	return default_policy;
+}
+
+static const char *const rational_names[] = {
+	[RATIONAL_NONE] = "none",
+	[RATIONAL_FRACTION] = "fraction",
+	[RATIONAL_INTEGER] = "integer",
+};
+
+/*
+ * Find form of rationals by name. Returns -1 if there is no such form
+ */
+int
+rational_from_name(const char *name)
+{
+	for (int i = 0; i < RATIONAL_COUNT; i++)
+		if (strcmp(name, rational_names[i]) == 0)
+			return i;
+	return -1;
+}
+
+/*
+ * Make numbers of programs compiled from now on rationals printed in
+ * given form, RATIONAL_NONE turns them back into integers
+ */
+void
+set_rational(int form)
+{
+	default_rational = form;
+}
+
+int
+get_rational(void)
+{
+	return default_rational;
+}
+
+/*
+ * Set number of decimal digits after point of numbers in programs
+ * compiled from now on, 0 for integers
+ */
+void
+set_scale(int scale)
+{
+	default_scale = scale;
+}
+
+int
+get_scale(void)
+{
+	return default_scale;
+}
+
+/*
+ * Make numbers of programs compiled from now on residues modulo n,
+ * 0 turns them back into integers
+ */
+void
+set_modulus(unsigned long long n)
+{
+	init_modulus(&default_mod, n);
+}
+
+unsigned long long
+get_modulus(void)
+{
+	return default_mod.n;
+}
+
+/*
+ * Parse decimal number with optional sign and point into value scaled
+ * by 10^scale, extra digits are rounded half away from zero. Returns
+ * NULL or error string like strtonum does
+ */
+const char *
+parse_decimal(const char *s, int scale, long long int *num)
+{
+	unsigned __int128 v = 0;
+	int neg = 0, digits = 0, frac = -1, round = 0;
+
+	if (*s == '-' || *s == '+')
+		neg = *s++ == '-';
+	for (; *s != '\0'; s++) {
+		if (*s == '.' && frac == -1) {
+			frac = 0;
+			continue;
+		}
+		if (!isdigit((unsigned char)*s))
+			return "invalid";
+		digits++;
+		if (frac >= scale) {
+			/* Only the first dropped digit decides rounding */
+			if (frac++ == scale)
+				round = *s >= '5';
+			continue;
+		}
+		if (frac >= 0)
+			frac++;
+		if ((v = v * 10 + (*s - '0')) >
+		    (unsigned __int128)LLONG_MAX + 1)
+			return "too large";
+	}
+	if (digits == 0)
+		return "invalid";
+	for (frac = frac < 0 ? 0 : frac; frac < scale; frac++)
+		if ((v *= 10) > (unsigned __int128)LLONG_MAX + 1)
+			return "too large";
+	v += round;
+	if (v > (unsigned __int128)LLONG_MAX + neg)
+		return neg ? "too small" : "too large";
+	*num = neg ? (long long int)-(unsigned long long)v : (long long int)v;
+	return NULL;
+}
+
+/*
+ * Print value scaled by 10^scale into buf of size bytes like snprintf.
+ * Residues are converted back from Montgomery form
+ */
+int
+format_value(char *buf, size_t size, long long int v, int scale)
+{
+	unsigned long long u, d;
+
+	if (default_mod.n != 0)
+		return snprintf(buf, size, "%llu",
+		    redc(&default_mod, (unsigned long long)v));
+	if (scale == 0)
+		return snprintf(buf, size, "%lld", v);
+	u = v < 0 ? -(unsigned long long)v : (unsigned long long)v;
+	d = powers10[scale];
+	return snprintf(buf, size, "%s%llu.%0*llu", v < 0 ? "-" : "",
+	    u / d, scale, u % d);
+}
+
+/*
+ * Print rational num/den like format_value prints numbers, in form set
+ * by set_rational: fraction, which has no denominator if it is 1, or
+ * integer truncated towards zero
+ */
+int
+format_rational(char *buf, size_t size, long long int num, long long int den)
+{
+	if (default_rational == RATIONAL_INTEGER)
+		return snprintf(buf, size, "%lld", num / den);
+	if (den == 1)
+		return snprintf(buf, size, "%lld", num);
+	return snprintf(buf, size, "%lld/%lld", num, den);
+}
+
+/*
+ * Execute instruction of program out of order, for evaluators which
+ * skip some of them
+ */
+int
+run_insn(const struct program *p, const struct insn *ip,
+    long long int *frame)
+{
+	switch (p->policy) {
+	case POLICY_WRAP:
+		return step_wrap(p, ip, frame);
+	case POLICY_SATURATE:
+		return step_saturate(p, ip, frame);
+	default:
+		return step_checked(p, ip, frame);
+	}
+}
+
+/*
+ * Allocate frames of block for program, slot s of frame k is at
+ * s * BLOCK + k. Literals are put into every frame
+ */
+long long int *
+block_alloc(const struct program *p)
+{
+	long long int *frame;
+
+	if ((frame = calloc((p->nframe ? p->nframe : 1) * (size_t)BLOCK,
+	    sizeof(*frame))) == NULL)
+		errx(1, "Couldn't allocate frame");
+	for (int i = 0; i < p->nlits; i++)
+		for (int k = 0; k < BLOCK; k++)
+			frame[(size_t)i * BLOCK + k] = p->lits[i];
+	return frame;
+}
+
+/*
+ * Evaluate compiled program without jumps in n frames of block.
+ * Errors are stored in errors, which should be zeroed
+ */
+void
+run_block(const struct program *p, long long int *frame, int n,
+    unsigned char *errors)
+{
+	switch (p->policy) {
+	case POLICY_WRAP:
+		block_wrap(p, frame, n, errors);
+		break;
+	case POLICY_SATURATE:
+		block_saturate(p, frame, n, errors);
+		break;
+	default:
+		block_checked(p, frame, n, errors);
+		break;
+	}
+}
+
+/*
+ * Evaluate compiled program in frame prepared by frame_alloc.
+ * Result is stored in *res if there is any. Policy is chosen once
+ * for the whole program
+ */
+int
+run_program(const struct program *p, long long int *frame,
+    long long int *res)
+{
+	return runners[p->policy](p, frame, res);
+}
+
+void
+free_program(struct program *p)
+{
+	free(p->code);
+	free(p->lits);
+	free(p->vars);
+	memset(p, 0, sizeof(*p));
+	p->result = -1;
+}
@@ -0,0 +1,219 @@
+/*
+ * Copyright © 2022 — 2023 Artsiom Karakin <karakin2000@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Evaluator loop, vm.c includes it once for every arithmetic policy.
+ * Includer defines POLICY(name), which makes name of the function for
+ * this policy, and POLICY_ADD, POLICY_SUB, POLICY_MUL, POLICY_DIV
+ * taking operands and pointer to result and returning error code, and
+ * POLICY_FIT storing 128 bit result of decimal operation.
+ * Loop of every policy has only its own kernels inlined. Modular
+ * operations never overflow, they are the same for every policy, and
+ * so are operations on rationals, which always fail on overflow.
+ * Block loop runs program on BLOCK frames at once.
+ */
+
+/*
+ * Execute one instruction. Returns error code
+ */
+static inline int
+POLICY(step)(const struct program *p, const struct insn *ip,
+    long long int *frame)
+{
+	switch (ip->op) {
+	case OP_ADD:
+		return POLICY_ADD(frame[ip->a], frame[ip->b], &frame[ip->dst]);
+	case OP_SUB:
+		return POLICY_SUB(frame[ip->a], frame[ip->b], &frame[ip->dst]);
+	case OP_MUL:
+		return POLICY_MUL(frame[ip->a], frame[ip->b], &frame[ip->dst]);
+	case OP_DIV:
+		return POLICY_DIV(frame[ip->a], frame[ip->b], &frame[ip->dst]);
+	case OP_DMUL:
+		return POLICY_FIT(dec_mul(frame[ip->a], frame[ip->b], ip->aux),
+		    &frame[ip->dst]);
+	case OP_DDIV:
+		if (frame[ip->b] == 0)
+			return CALC_DIVZERO;
+		return POLICY_FIT(dec_div(frame[ip->a], frame[ip->b], ip->aux),
+		    &frame[ip->dst]);
+	case OP_MODADD:
+		frame[ip->dst] = mod_add(&p->mod, frame[ip->a], frame[ip->b]);
+		break;
+	case OP_MODSUB:
+		frame[ip->dst] = mod_sub(&p->mod, frame[ip->a], frame[ip->b]);
+		break;
+	case OP_MODMUL:
+		frame[ip->dst] = mont_mul(&p->mod, frame[ip->a], frame[ip->b]);
+		break;
+	case OP_MODDIV:
+		return mod_div(&p->mod, frame[ip->a], frame[ip->b],
+		    &frame[ip->dst]);
+	case OP_LT:
+	case OP_GT:
+	case OP_LE:
+	case OP_GE:
+	case OP_EQ:
+	case OP_NE:
+		if (ip->aux == CMP_RATIONAL)
+			return rational_op(p, ip, frame);
+		frame[ip->dst] = compare(p, ip, frame[ip->a], frame[ip->b]);
+		break;
+	case OP_QADD:
+	case OP_QSUB:
+	case OP_QMUL:
+	case OP_QDIV:
+	case OP_QMOV:
+		return rational_op(p, ip, frame);
+	case OP_MOV:
+		frame[ip->dst] = frame[ip->a];
+		break;
+	case OP_TRAP:
+		return ip->aux;
+	case OP_FADD:
+		frame[ip->dst] = frame[ip->a] + frame[ip->b];
+		break;
+	case OP_FSUB:
+		frame[ip->dst] = frame[ip->a] - frame[ip->b];
+		break;
+	case OP_FMUL:
+		frame[ip->dst] = frame[ip->a] * frame[ip->b];
+		break;
+	case OP_FDIV:
+		frame[ip->dst] = frame[ip->a] / frame[ip->b];
+		break;
+	case OP_MDIV:
+		frame[ip->dst] = divide_magic(frame[ip->a], frame[ip->b],
+		    ip->aux);
+		break;
+	}
+	return CALC_OK;
+}
+
+static int
+POLICY(run)(const struct program *p, long long int *frame,
+    long long int *res)
+{
+	const struct insn *ip, *end;
+	int error;
+
+	for (ip = p->code, end = ip + p->ncode; ip < end; ip++) {
+		/* Jumps go forward only, to the end at most */
+		if (ip->op == OP_JZ) {
+			if (frame[ip->a] == 0)
+				ip = p->code + ip->dst - 1;
+			continue;
+		}
+		if (ip->op == OP_JMP) {
+			ip = p->code + ip->dst - 1;
+			continue;
+		}
+		if ((error = POLICY(step)(p, ip, frame)) != CALC_OK)
+			return error;
+	}
+	if (p->result >= 0)
+		*res = frame[p->result];
+	return CALC_OK;
+}
+
+/*
+ * Execute program without jumps on n frames of block, see block_alloc.
+ * Every instruction is done for all of them before the next one, and
+ * simple operations are loops compiler may vectorize. Error of every
+ * frame is stored in errors. Frames which failed go on with garbage,
+ * which is never divided by
+ */
+static void
+POLICY(block)(const struct program *p, long long int *frame, int n,
+    unsigned char *errors)
+{
+	const struct insn *ip, *end;
+	struct insn one;
+	long long int *d, *a, *b, lane[3];
+	int e;
+
+	for (ip = p->code, end = ip + p->ncode; ip < end; ip++) {
+		d = frame + (size_t)ip->dst * BLOCK;
+		a = frame + (size_t)ip->a * BLOCK;
+		b = frame + (size_t)ip->b * BLOCK;
+		switch (ip->op) {
+		case OP_ADD:
+			for (int k = 0; k < n; k++) {
+				e = POLICY_ADD(a[k], b[k], &d[k]);
+				errors[k] = errors[k] ? errors[k] : e;
+			}
+			break;
+		case OP_SUB:
+			for (int k = 0; k < n; k++) {
+				e = POLICY_SUB(a[k], b[k], &d[k]);
+				errors[k] = errors[k] ? errors[k] : e;
+			}
+			break;
+		case OP_MUL:
+			for (int k = 0; k < n; k++) {
+				e = POLICY_MUL(a[k], b[k], &d[k]);
+				errors[k] = errors[k] ? errors[k] : e;
+			}
+			break;
+		case OP_FADD:
+			for (int k = 0; k < n; k++)
+				d[k] = (unsigned long long)a[k] + b[k];
+			break;
+		case OP_FSUB:
+			for (int k = 0; k < n; k++)
+				d[k] = (unsigned long long)a[k] - b[k];
+			break;
+		case OP_FMUL:
+			for (int k = 0; k < n; k++)
+				d[k] = (unsigned long long)a[k] * b[k];
+			break;
+		case OP_MOV:
+			for (int k = 0; k < n; k++)
+				d[k] = a[k];
+			break;
+		case OP_MDIV:
+			for (int k = 0; k < n; k++)
+				d[k] = divide_magic(a[k], b[k], ip->aux);
+			break;
+		case OP_TRAP:
+			for (int k = 0; k < n; k++)
+				errors[k] = errors[k] ? errors[k] : ip->aux;
+			return;
+		default:
+			/* Everything else is done by step on frame of lane */
+			one = *ip;
+			one.op = ip->op == OP_FDIV ? OP_DIV : ip->op;
+			one.a = 0;
+			one.b = 1;
+			one.dst = 2;
+			for (int k = 0; k < n; k++) {
+				lane[0] = a[k];
+				lane[1] = b[k];
+				e = POLICY(step)(p, &one, lane);
+				d[k] = lane[2];
+				errors[k] = errors[k] ? errors[k] : e;
+			}
+			break;
+		}
+	}
+}
+
+#undef POLICY
+#undef POLICY_FIT
+#undef POLICY_ADD
+#undef POLICY_SUB
+#undef POLICY_MUL
+#undef POLICY_DIV